@@ -4,19 +4,31 @@
 
 # Add inputs and outputs from these tool invocations to the build variables 
 C_SRCS += \
+../alphabet.c \
+../arena.c \
 ../model-2.c \
+../pool.c \
 ../predict.c \
-../string16.c 
+../string16.c \
+../writer.c 
 
 OBJS += \
+./alphabet.o \
+./arena.o \
 ./model-2.o \
+./pool.o \
 ./predict.o \
-./string16.o 
+./string16.o \
+./writer.o 
 
 C_DEPS += \
+./alphabet.d \
+./arena.d \
 ./model-2.d \
+./pool.d \
 ./predict.d \
-./string16.d 
+./string16.d \
+./writer.d 
 
 
 # Each subdirectory must supply rules for building sources it contributes
@@ -0,0 +1,80 @@
+/*******************************************************
+ * alphabet.c
+ *
+ * This module maps the sparse 16-bit symbol codes found in
+ * the input files to dense ids and back again.  See
+ * alphabet.h for the data structure.
+ *
+ * *****************************************************/
+#include <stdlib.h>			// for malloc(), realloc(), free()
+#include <string.h>			// for memset()
+#include "alphabet.h"
+
+/* alphabet_init - set up an empty alphabet */
+void alphabet_init( ALPHABET *a) {
+	memset( a, 0, sizeof( ALPHABET));
+}
+
+/* alphabet_add - return the id of the given code, giving it the next
+ * id if it hasn't been seen before.  Returns -1 if memory runs out
+ * (or the alphabet is full).
+ */
+SYMBOL_TYPE alphabet_add( ALPHABET *a, SYMBOL_TYPE code) {
+	SYMBOL_TYPE *new_codes;
+	int new_capacity;
+
+	if (a->id_of == NULL) {
+		a->id_of = (SYMBOL_TYPE *) malloc( ALPHABET_NUM_CODES * sizeof( SYMBOL_TYPE));
+		if (a->id_of == NULL)
+			return -1;
+		memset( a->id_of, 0xFF, ALPHABET_NUM_CODES * sizeof( SYMBOL_TYPE));	// all -1
+	}
+	if (a->id_of[ (unsigned short) code ] >= 0)
+		return (a->id_of[ (unsigned short) code ]);
+
+	if (a->size == ALPHABET_UNKNOWN)
+		return -1;
+	if (a->size == a->capacity) {
+		new_capacity = (a->capacity == 0) ? 256 : 2 * a->capacity;
+		new_codes = (SYMBOL_TYPE *) realloc( a->code_of, new_capacity * sizeof( SYMBOL_TYPE));
+		if (new_codes == NULL)
+			return -1;
+		a->code_of = new_codes;
+		a->capacity = new_capacity;
+	}
+	a->code_of[ a->size ] = code;
+	a->id_of[ (unsigned short) code ] = a->size;
+	return (a->size++);
+}
+
+/* alphabet_id - return the id of the given code, or ALPHABET_UNKNOWN
+ * if the code isn't in the alphabet.
+ */
+SYMBOL_TYPE alphabet_id( ALPHABET *a, SYMBOL_TYPE code) {
+	if (a->id_of == NULL || a->id_of[ (unsigned short) code ] < 0)
+		return (ALPHABET_UNKNOWN);
+	return (a->id_of[ (unsigned short) code ]);
+}
+
+/* alphabet_code - return the code that was given the id 'id' */
+SYMBOL_TYPE alphabet_code( ALPHABET *a, SYMBOL_TYPE id) {
+	return (a->code_of[ id ]);
+}
+
+/* alphabet_clear - empty the alphabet, keeping its memory.  Only
+ * the entries that were used are cleared, so this is quick.
+ */
+void alphabet_clear( ALPHABET *a) {
+	int i;
+
+	for (i = 0; i < a->size; i++)
+		a->id_of[ (unsigned short) a->code_of[ i ] ] = -1;
+	a->size = 0;
+}
+
+/* alphabet_destroy - free the alphabet's memory. */
+void alphabet_destroy( ALPHABET *a) {
+	free( a->id_of);
+	free( a->code_of);
+	alphabet_init( a);
+}
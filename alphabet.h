@@ -0,0 +1,45 @@
+/**************************************************
+ * alphabet.h
+ *
+ * The symbols in the trace files are sparse 16-bit codes
+ * (locations are 0x2320-0x25FF, start times 0x2620-0x2DFF),
+ * but any one trace only uses a few hundred of them.  An
+ * ALPHABET is a dictionary that gives every code it has seen
+ * a dense id, 0..size-1, in the order the codes were first
+ * seen.  Arrays indexed by symbol then only need one entry
+ * per symbol that is really used.  Going from a code to an
+ * id, or back, is a single array access.
+ *
+ * ************************************************/
+
+#ifndef ALPHABET_H_
+#define ALPHABET_H_
+
+#include "string16.h"		// for SYMBOL_TYPE
+
+#define ALPHABET_NUM_CODES	65536	// number of possible 16-bit codes
+#define ALPHABET_UNKNOWN	0x7FFF	// id given for a code that isn't in the alphabet
+
+/*
+ * id_of[] is indexed by the code (taken as an unsigned short) and holds
+ * the code's id, or -1 if the code hasn't been seen.  code_of[] is
+ * indexed by the id and holds the code.  A zero-filled ALPHABET is a
+ * valid, empty alphabet; the arrays are allocated when the first code
+ * is added.
+ */
+typedef struct {
+	SYMBOL_TYPE *id_of;		// code -> id
+	SYMBOL_TYPE *code_of;	// id -> code
+	int size;				// number of codes in the alphabet
+	int capacity;			// allocated length of code_of[]
+} ALPHABET;
+
+/* Function Prototypes */
+void alphabet_init( ALPHABET *a);
+SYMBOL_TYPE alphabet_add( ALPHABET *a, SYMBOL_TYPE code);
+SYMBOL_TYPE alphabet_id( ALPHABET *a, SYMBOL_TYPE code);
+SYMBOL_TYPE alphabet_code( ALPHABET *a, SYMBOL_TYPE id);
+void alphabet_clear( ALPHABET *a);
+void alphabet_destroy( ALPHABET *a);
+
+#endif /*ALPHABET_H_*/
@@ -0,0 +1,180 @@
+/*******************************************************
+ * arena.c
+ *
+ * This module implements a region (arena) allocator for
+ * the model.  See arena.h for the data structures.
+ *
+ * Two kinds of allocation are supported:
+ *   arena_alloc() hands out fixed sized objects (such as a
+ *     CONTEXT table) by bumping a pointer in the current chunk.
+ *     These are never given back individually.
+ *   arena_alloc_block() hands out variable sized arrays (such
+ *     as a STATS or LINKS array).  The size is rounded up to a
+ *     power of two, and blocks that are given back with
+ *     arena_free_block() are reused for the next request of
+ *     the same size class.
+ *
+ * Nothing is returned to malloc until arena_destroy() is called.
+ * arena_reset() empties the arena in constant time, keeping the
+ * chunks so that the next model built in the arena does not have
+ * to go back to malloc at all.
+ *
+ * *****************************************************/
+#include <stdlib.h>			// for malloc(), free()
+#include <string.h>			// for memset(), memcpy()
+#include "arena.h"
+
+/* Bytes taken by a chunk header, rounded up so the data stays aligned. */
+#define CHUNK_HEADER_SIZE	\
+	((sizeof( ARENA_CHUNK ) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+#define CHUNK_DATA( chunk )	((char *) (chunk) + CHUNK_HEADER_SIZE)
+
+/* Return the size class (power of two) that holds 'size' bytes. */
+static int size_class( size_t size) {
+	int class_index = ARENA_MIN_CLASS;
+
+	while (((size_t) 1 << class_index) < size)
+		class_index++;
+	return (class_index);
+}
+
+/* arena_init - set up an empty arena */
+void arena_init( ARENA *a) {
+	memset( a, 0, sizeof( ARENA));
+}
+
+/* arena_alloc - return 'size' bytes of zeroed memory from the arena.
+ * The memory stays allocated until the arena is reset or destroyed.
+ * Returns NULL if malloc fails.
+ */
+void * arena_alloc( ARENA *a, size_t size) {
+	ARENA_CHUNK *chunk, *last;
+	size_t chunk_size;
+	void *result;
+
+	size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+	// Move along the chain until a chunk has room.  Chunks after
+	// 'current' are left over from before the last arena_reset(),
+	// so their contents are stale and they are emptied as we reach them.
+	chunk = a->current;
+	last = a->current;
+	while (chunk != NULL && chunk->used + size > chunk->size) {
+		last = chunk;
+		chunk = chunk->next;
+		if (chunk != NULL)
+			chunk->used = 0;
+	}
+	if (chunk == NULL) {
+		// Out of chunks, get a new one and put it at the end of the chain.
+		chunk_size = (size > ARENA_CHUNK_SIZE) ? size : ARENA_CHUNK_SIZE;
+		chunk = (ARENA_CHUNK *) malloc( CHUNK_HEADER_SIZE + chunk_size);
+		if (chunk == NULL)
+			return NULL;
+		chunk->next = NULL;
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		a->reserved += CHUNK_HEADER_SIZE + chunk_size;
+		if (last == NULL)
+			a->first = chunk;
+		else
+			last->next = chunk;
+	}
+	a->current = chunk;
+	result = CHUNK_DATA( chunk) + chunk->used;
+	chunk->used += size;
+	a->in_use += size;
+	memset( result, 0, size);
+	return (result);
+}
+
+/* arena_block_size - number of bytes actually set aside for a block
+ * of 'size' bytes (0 for an empty block).
+ */
+size_t arena_block_size( size_t size) {
+	if (size == 0)
+		return 0;
+	return ((size_t) 1 << size_class( size));
+}
+
+/* arena_alloc_block - return a zeroed block big enough to hold 'size'
+ * bytes.  A recycled block of the same size class is used if there is one.
+ */
+void * arena_alloc_block( ARENA *a, size_t size) {
+	int class_index;
+	void *block;
+
+	if (size == 0)
+		return NULL;
+	class_index = size_class( size);
+	block = a->free_blocks[ class_index ];
+	if (block == NULL)
+		return (arena_alloc( a, (size_t) 1 << class_index));
+
+	// Pop the block off the free list (the link is stored in the block itself).
+	a->free_blocks[ class_index ] = *(void **) block;
+	a->in_use += (size_t) 1 << class_index;
+	memset( block, 0, (size_t) 1 << class_index);
+	return (block);
+}
+
+/* arena_realloc_block - change the size of a block, keeping its contents.
+ * If the new size falls in the same size class, the block does not move.
+ * Any bytes beyond the old size are zero.
+ */
+void * arena_realloc_block( ARENA *a, void *block, size_t old_size, size_t new_size) {
+	void *new_block;
+
+	if (block == NULL)
+		return (arena_alloc_block( a, new_size));
+	if (new_size == 0) {
+		arena_free_block( a, block, old_size);
+		return NULL;
+	}
+	if (size_class( old_size) == size_class( new_size)) {
+		if (new_size > old_size)
+			memset( (char *) block + old_size, 0, new_size - old_size);
+		return (block);
+	}
+	new_block = arena_alloc_block( a, new_size);
+	if (new_block == NULL)
+		return NULL;
+	memcpy( new_block, block, (old_size < new_size) ? old_size : new_size);
+	arena_free_block( a, block, old_size);
+	return (new_block);
+}
+
+/* arena_free_block - give a block back so it can be reused. */
+void arena_free_block( ARENA *a, void *block, size_t size) {
+	int class_index;
+
+	if (block == NULL || size == 0)
+		return;
+	class_index = size_class( size);
+	*(void **) block = a->free_blocks[ class_index ];
+	a->free_blocks[ class_index ] = block;
+	a->in_use -= (size_t) 1 << class_index;
+}
+
+/* arena_reset - throw away everything allocated from the arena.
+ * This takes constant time: the chunks are kept, and each one is
+ * emptied the next time arena_alloc() reaches it.
+ */
+void arena_reset( ARENA *a) {
+	memset( a->free_blocks, 0, sizeof( a->free_blocks));
+	a->current = a->first;
+	if (a->first != NULL)
+		a->first->used = 0;
+	a->in_use = 0;
+}
+
+/* arena_destroy - return all of the arena's memory to malloc. */
+void arena_destroy( ARENA *a) {
+	ARENA_CHUNK *chunk, *next;
+
+	for (chunk = a->first; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		free( chunk);
+	}
+	arena_init( a);
+}
@@ -0,0 +1,59 @@
+/**************************************************
+ * arena.h
+ *
+ * Prototypes for a region (arena) allocator.  The model
+ * allocates thousands of small CONTEXT tables and STATS/LINKS
+ * arrays; instead of handing each one to malloc, they are
+ * carved out of large chunks owned by an ARENA.  Variable
+ * sized arrays come from power-of-two size classes so that
+ * a block that is given back can be reused by the next
+ * table that needs one of the same size.  The whole arena
+ * can be reset (or torn down) in one call.
+ *
+ * ************************************************/
+
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>		// for size_t
+
+#define ARENA_CHUNK_SIZE	65536	// bytes requested from malloc at a time
+#define ARENA_ALIGNMENT		8		// every allocation is aligned to this
+#define ARENA_MIN_CLASS		3		// smallest pooled block is 2^3 bytes
+#define ARENA_NUM_CLASSES	40		// size classes 2^0 .. 2^39 (the low ones are unused)
+
+/*
+ * Memory is obtained from malloc in chunks.  Each chunk starts
+ * with this header; the usable bytes follow it.
+ */
+typedef struct arena_chunk {
+	struct arena_chunk *next;	// next chunk in the chain
+	size_t size;				// usable bytes in this chunk
+	size_t used;				// bytes handed out from this chunk
+} ARENA_CHUNK;
+
+/*
+ * An ARENA is the owner of all of its chunks.  Allocation just
+ * bumps the 'used' count of the current chunk.  Blocks that are
+ * given back are kept on a free list for their size class.
+ * A zero-filled ARENA is a valid, empty arena.
+ */
+typedef struct {
+	ARENA_CHUNK *first;			// first chunk in the chain
+	ARENA_CHUNK *current;		// chunk that allocations are carved from
+	void *free_blocks[ ARENA_NUM_CLASSES ];	// recycled blocks, one list per size class
+	size_t reserved;			// bytes obtained from malloc (including headers)
+	size_t in_use;				// bytes handed out and not given back
+} ARENA;
+
+/* Function Prototypes */
+void arena_init( ARENA *a);
+void * arena_alloc( ARENA *a, size_t size);
+size_t arena_block_size( size_t size);
+void * arena_alloc_block( ARENA *a, size_t size);
+void * arena_realloc_block( ARENA *a, void *block, size_t old_size, size_t new_size);
+void arena_free_block( ARENA *a, void *block, size_t size);
+void arena_reset( ARENA *a);
+void arena_destroy( ARENA *a);
+
+#endif /*ARENA_H_*/
@@ -10,7 +10,15 @@
  *
  * Each context is stored in a special CONTEXT structure, which is
  * documented below.  Context tables are not created until the
- * context is seen, and they are never destroyed.
+ * context is seen, and they are never destroyed individually, unless
+ * the model has been given a memory budget (see prune_model()).
+ * All of the tables live in a single arena (see arena.c), so the
+ * whole model can be thrown away at once with reset_model().
+ *
+ * Inside the model, symbols are dense ids (see alphabet.c) rather
+ * than the sparse 16-bit codes found in the input files.  The routines
+ * that the rest of the program calls take and return codes, and do the
+ * translation themselves.
  *
  */
 #include <stdio.h>
@@ -18,45 +26,83 @@
 #include <string.h>
 #include <ctype.h>	// for isprint() declaration
 #include <math.h>		// for log10() function;
+#ifndef NO_MMAP
+#include <sys/mman.h>	// for mmap(), to share saved models between processes
+#include <sys/stat.h>	// for fstat()
+#endif
 #include "coder.h"
 #include "model.h"
+#include "arena.h"		// for the model's memory arena
+#include "alphabet.h"	// for mapping symbol codes to dense ids
 #include "string16.h"	// for handling 16-bit char 'strings'
 #include "predict.h"	// for printing symbol type
 /*
- * max_order is the maximum order that will be maintained by this
- * program.  EXPAND-2 and COMP-2 both will modify this int based
- * on command line parameters.
- */
-int max_order=3;
-/*
- * *contexts[] is an array of current contexts.  If I want to find
+ * Everything that belongs to a model is kept in its MODEL structure
+ * (see model.h), and every routine here is given the model to use.
+ * The model's max_order is the maximum order that it maintains.
+ * model->contexts[] is an array of current contexts.  If I want to find
  * the order 0 context for the current state of the model, I just
  * look at contexts[0].  This array of context pointers is set up
  * every time the model is updated.
- */
-CONTEXT **contexts;
-/*
- * current_order contains the current order of the model.  It starts
- * at max_order, and is decremented every time an ESCAPE is sent.  It
+ *
+ * The queries keep their own contexts[] and current_order in a
+ * MODEL_SCRATCH.  The query's current_order starts at the order of the
+ * context it found, and is decremented every time an ESCAPE is sent.  It
  * will only go down to -1 for normal symbols, but can go to -2 for
  * EOF and FLUSH.
  */
-int current_order;
 /*
  * This variable tells COMP-2.C that the FLUSH symbol can be
  * sent using this model.
  */
 int flushing_enabled=0;
 /*
- * This table contains the cumulative totals for the current context.
+ * The scratch's totals[] contains the cumulative totals for the current context.
  * Because this program is using exclusion, totals has to be calculated
  * every time a context is used.  The scoreboard array keeps track of
  * symbols that have appeared in higher order models, so that they
  * can be excluded from lower order context total calculations.
+ * Rather than a flag, each symbol's place on the scoreboard holds the
+ * epoch it was last excluded in, and clear_scoreboard() starts a new
+ * epoch, so clearing it doesn't cost a pass over the whole alphabet
+ * for every symbol that is looked up.
+ *
+ * The model's alphabet gives each symbol code that the model has been
+ * trained on a dense id, and the tables store the ids.  So totals[]
+ * only needs to be as big as the biggest table, and scoreboard[] only
+ * needs one entry per symbol that has really been seen (instead of one
+ * for every possible code).  The null table's entries aren't real
+ * symbols, so they all hold NULL_TABLE_SYMBOL, which is never an id.
+ */
+#define NULL_TABLE_SYMBOL	-3
+
+// True if the symbol is on the scratch's scoreboard (see clear_scoreboard()).
+#define EXCLUDED( scratch, symbol )	( (scratch)->scoreboard[ symbol ] == (scratch)->epoch )
+
+// The count of entry e of node n, rescaled for coding (see scale_frozen_node()).
+#define FROZEN_COUNT( f, n, e )	\
+	( (f)->counts[ (f)->nodes[ n ].first + (e) ] >> (f)->nodes[ n ].scale_shift )
+
+/*
+ * Every CONTEXT table, and every symbol, count and link array hanging off
+ * of one, is allocated from the model's arena instead of from the heap.
+ * order_bytes[] keeps track of how many arena bytes belong to the
+ * tables of each order (indexed like contexts[], from -2 up), so that
+ * print_model_allocation() can show where the memory went.
+ *
+ * memory_budget is the most arena memory (in bytes) that the model may
+ * use while it is being trained, or 0 for no limit.  When the arena
+ * goes past prune_limit, add_character_to_model() calls prune_model()
+ * to throw some tables away.
+ *
+ * model->frozen is the read-only copy of the model made by freeze_model().
+ * The query routines (traverse_tree, predict_next, convert_int_to_symbol,
+ * probability and the rest) only ever use the frozen copy, so a query
+ * freezes the model first if it isn't frozen (see start_query()), and
+ * the scratch's contexts[] holds the node numbers of the current
+ * contexts, indexed from -2 up.  Changing the model throws the frozen
+ * copy away (see thaw_model()).
  */
-short int totals[ RANGE_OF_SYMBOLS+2 ];
-char scoreboard[ RANGE_OF_SYMBOLS ];
-int alloc_count=0;		// number of CONTEXT structs allocated.
 
 /*
  * Global variables for routine that counts the tables once
@@ -71,17 +117,61 @@ int num_children[1500];	// number of children in each context table
  * Local procedure declarations.
  */
 void error_exit( char *message );
-void update_table( CONTEXT *table, SYMBOL_TYPE symbol );
-void rescale_table( CONTEXT *table );
-void totalize_table( CONTEXT *table );
-CONTEXT *shift_to_next_context( CONTEXT *table, SYMBOL_TYPE c, int order);
-CONTEXT *allocate_next_order_table( CONTEXT *table,
+void update_table( MODEL *model, CONTEXT *table, SYMBOL_TYPE symbol );
+void rescale_table( MODEL *model, CONTEXT *table );
+void rescale_saturated_table( MODEL *model, CONTEXT *table );
+void totalize_table( MODEL *model, MODEL_SCRATCH *scratch, int n );
+CONTEXT *new_context( MODEL *model, int order );
+void *resize_table_array( MODEL *model, CONTEXT *table, void *array, size_t element_size,
+                          int old_count, int new_count );
+int set_table_capacity( MODEL *model, CONTEXT *table, int new_capacity );
+int grow_table( MODEL *model, CONTEXT *table, int need_links );
+void shrink_tables( MODEL *model, CONTEXT *table );
+long prune_tables( MODEL *model, CONTEXT *table, int threshold );
+int can_prune_table( MODEL *model, CONTEXT *table );
+void free_context( MODEL *model, CONTEXT *table );
+SYMBOL_TYPE symbol_id( MODEL *model, SYMBOL_TYPE c );
+SYMBOL_TYPE add_symbol_to_alphabet( MODEL *model, SYMBOL_TYPE c );
+void fit_totals( MODEL_SCRATCH *scratch, int num_entries );
+void fit_scoreboard( MODEL *model, MODEL_SCRATCH *scratch );
+void exclude_symbol( MODEL_SCRATCH *scratch, SYMBOL_TYPE symbol );
+void start_query( MODEL *model, MODEL_SCRATCH *scratch );
+void report_prediction( MODEL *model, MODEL_SCRATCH *scratch, STRUCT_PREDICTION * results,
+                        int max_predictions, float mass );
+void view_context( MODEL *model, MODEL_SCRATCH *scratch, PREDICTION_VIEW *view,
+                   int max_predictions, float mass );
+void load_rolling_context( MODEL *model, MODEL_SCRATCH *scratch );
+unsigned char predict_from_rolling_context( MODEL *model, MODEL_SCRATCH *scratch, STRUCT_PREDICTION * results,
+                                            int max_predictions, float mass );
+void load_context_chain( MODEL *model, MODEL_SCRATCH *scratch );
+int hash_cell( CONTEXT *table, SYMBOL_TYPE symbol );
+int probe_hash( const int *hash, int hash_size, const SYMBOL_TYPE *symbols,
+                SYMBOL_TYPE symbol );
+int find_symbol_in_table( CONTEXT *table, SYMBOL_TYPE symbol );
+void build_table_hash( MODEL *model, CONTEXT *table );
+void hash_new_symbol( MODEL *model, CONTEXT *table );
+CONTEXT *shift_to_next_context( MODEL *model, CONTEXT *table, SYMBOL_TYPE c, int order);
+CONTEXT *allocate_next_order_table( MODEL *model,
+                                    CONTEXT *table,
                                     SYMBOL_TYPE symbol,
                                     CONTEXT *lesser_context );
+void recursive_flush( MODEL *model, CONTEXT *table );
+void count_frozen_tables( CONTEXT *table, FROZEN_HEADER *header );
+size_t point_into_frozen_image( FROZEN_MODEL *f, FROZEN_HEADER *header );
+int check_frozen_header( FROZEN_HEADER *header );
+int check_frozen_nodes( FROZEN_HEADER *header );
+FROZEN_HEADER *map_model_file( FILE *model_file, size_t image_bytes,
+                               void **mapping, size_t *mapping_bytes );
+void install_frozen_model( MODEL *model, FROZEN_HEADER *image );
+int frozen_find( FROZEN_MODEL *f, int n, SYMBOL_TYPE symbol );
+void scale_frozen_node( FROZEN_MODEL *f, int n, int is_leaf );
+int frozen_interval( MODEL *model, MODEL_SCRATCH *scratch, int n, SYMBOL_TYPE c, SYMBOL *s );
+int frozen_total( FROZEN_MODEL *f, int n );
 
 /*
  * This routine has to get everything set up properly so that
- * the model can be maintained properly.  The first step is to create
+ * the model can be maintained properly.  The model has to be empty
+ * (all zeros, or given back with free_model()).  The first step is to create
  * the *contexts[] array used later to find current context tables.
  * The *contexts[] array indices go from -2 up to max_order, so
  * the table needs to be fiddled with a little.  This routine then
@@ -89,61 +179,409 @@ CONTEXT *allocate_next_order_table( CONTEXT *table,
  * since they aren't quite like other tables.  Then the current
  * context is set to \0, \0, \0, ... and the appropriate tables
  * are built to support that context.  The current order is set
- * to max_order, the scoreboard is cleared, and the system is
- * ready to go.
+ * to max_order, and the system is ready to go.
  */
 
-void initialize_model()
+void initialize_model( MODEL *model, int max_order )
 {
     int i;
     CONTEXT *null_table;
     CONTEXT *control_table;
     
-    current_order = max_order;
-    contexts = (CONTEXT **) calloc( sizeof( CONTEXT * ), 10 );
-    alloc_count += 10;
-    if ( contexts == NULL )
+    model->max_order = max_order;
+    model->current_order = max_order;
+    thaw_model( model );
+    alphabet_clear( &model->alphabet );
+    add_symbol_to_alphabet( model, 0 );	// the starting context is all 0's, so 0 gets id 0
+    model->contexts = (CONTEXT **) arena_alloc( &model->arena, sizeof( CONTEXT * ) * 10 );
+    model->alloc_count += 10;
+    if ( model->contexts == NULL )
+        error_exit( "Failure #1: allocating context table!" );
+    model->contexts += 2;
+    model->order_bytes = (long *) arena_alloc( &model->arena, sizeof( long ) * 10 );
+    if ( model->order_bytes == NULL )
         error_exit( "Failure #1: allocating context table!" );
-    contexts += 2;
-    null_table = (CONTEXT *) calloc( sizeof( CONTEXT ), 1 );
-    alloc_count++;
+    model->order_bytes += 2;
+    null_table = new_context( model, -1 );
+    model->alloc_count++;
     if ( null_table == NULL )
         error_exit( "Failure #2: allocating null table!" );
-    null_table->max_index = -1;
-    contexts[ -1 ] = null_table;
+    model->contexts[ -1 ] = null_table;
     for ( i = 0 ; i <= max_order ; i++ )
-        contexts[ i ] = allocate_next_order_table( contexts[ i-1 ],
-                                               0,
-                                               contexts[ i-1 ] );
-    alloc_count += max_order;
-    handle_free( (char __handle *) null_table->stats );
-    null_table->stats =
-         (STATS __handle *) handle_calloc( sizeof( STATS ) * 500 );  // HERE was 256
-    if ( null_table->stats == NULL )
+        model->contexts[ i ] = allocate_next_order_table( model,
+                                                      model->contexts[ i-1 ],
+                                                      0,
+                                                      model->contexts[ i-1 ] );
+    model->alloc_count += max_order;
+    if ( !set_table_capacity( model, null_table, 500 ) )  // HERE was 256
         error_exit( "Failure #3: allocating null table!" );
     null_table->max_index = 499;  // TEST TEST TEST  was 256
     for ( i=0 ; i < 500 ; i++ )  // TEST TEST was 255
     {
-        null_table->stats[ i ].symbol = (unsigned char) i;
-        null_table->stats[ i ].counts = 1;
+        null_table->symbols[ i ] = NULL_TABLE_SYMBOL;	// was (unsigned char) i
+        null_table->counts[ i ] = 1;
     }
 
-    control_table = (CONTEXT *) calloc( sizeof(CONTEXT), 1 );
+    control_table = new_context( model, -2 );
     if ( control_table == NULL )
         error_exit( "Failure #4: allocating null table!" );
-    alloc_count++;
-    control_table->stats =
-         (STATS __handle *) handle_calloc( sizeof( STATS ) * 2 );
-    if ( control_table->stats == NULL )
+    model->alloc_count++;
+    if ( !set_table_capacity( model, control_table, 2 ) )
         error_exit( "Failure #5: allocating null table!" );
-    contexts[ -2 ] = control_table;
+    model->contexts[ -2 ] = control_table;
     control_table->max_index = 1;
-    control_table->stats[ 0 ].symbol = -FLUSH;
-    control_table->stats[ 0 ].counts = 1;
-    control_table->stats[ 1 ].symbol =- DONE;
-    control_table->stats[ 1 ].counts = 1;
+    control_table->symbols[ 0 ] = -FLUSH;
+    control_table->counts[ 0 ] = 1;
+    control_table->symbols[ 1 ] =- DONE;
+    control_table->counts[ 1 ] = 1;
+    model->prune_limit = (size_t) model->memory_budget;
+}
+
+/*
+ * reset_model throws away every table in the model and starts over
+ * with an empty model, ready to be trained again.  Because all of the
+ * tables live in the model's arena, this doesn't have to walk the tree: the
+ * arena is simply emptied (which takes constant time and keeps its
+ * memory for the next model), and initialize_model() builds the
+ * starting tables again.  The memory budget is kept.
+ */
+void reset_model( MODEL *model )
+{
+    thaw_model( model );
+    arena_reset( &model->arena );
+    model->alloc_count = 0;
+    model->table_reallocs = 0;
+    model->table_reallocs_avoided = 0;
+    model->saturated_rescales = 0;
+    model->tables_pruned = 0;
+    model->prune_runs = 0;
+    initialize_model( model, model->max_order );
+}
+
+/*
+ * free_model gives all of the model's memory back to the system, and
+ * leaves the MODEL empty.  The model can't be used again until
+ * initialize_model() is called.
+ */
+void free_model( MODEL *model )
+{
+    thaw_model( model );
+    arena_destroy( &model->arena );
+    alphabet_destroy( &model->alphabet );
+    memset( model, 0, sizeof( MODEL ) );
+}
+
+/*
+ * initialize_scratch sets up an empty scratch for queries, and
+ * free_scratch gives its memory back.  One scratch can be used for
+ * queries on any number of models, one query at a time.
+ */
+void initialize_scratch( MODEL_SCRATCH *scratch )
+{
+    memset( scratch, 0, sizeof( MODEL_SCRATCH ) );
+    scratch->epoch = 1;		// an entry of 0 is never excluded
+    scratch->contexts = scratch->contexts_array + 2;
+}
+
+void free_scratch( MODEL_SCRATCH *scratch )
+{
+    free( scratch->totals );
+    free( scratch->scoreboard );
+    free( scratch->excluded );
+    initialize_scratch( scratch );
+}
+
+/*
+ * symbol_id returns the id that the model uses for the symbol code c.
+ * A code that the model hasn't been trained on gets ALPHABET_UNKNOWN,
+ * which won't be found in any table.  Negative codes are the special
+ * DONE and FLUSH symbols, and they are left alone.
+ */
+SYMBOL_TYPE symbol_id( MODEL *model, SYMBOL_TYPE c )
+{
+    if ( c < 0 )
+        return( c );
+    return( alphabet_id( &model->alphabet, c ) );
+}
+
+/*
+ * add_symbol_to_alphabet is used on symbols that are being added to
+ * the model.  It returns the symbol's id, giving it a new one if it is
+ * a new symbol.
+ */
+SYMBOL_TYPE add_symbol_to_alphabet( MODEL *model, SYMBOL_TYPE c )
+{
+    SYMBOL_TYPE id;
+
+    id = alphabet_add( &model->alphabet, c );
+    if ( id < 0 )
+        error_exit( "Error #13: adding a symbol to the alphabet!" );
+    return( id );
+}
+
+/*
+ * fit_scoreboard makes sure that a scratch's scoreboard (and its list of
+ * excluded symbols) has an entry for every symbol in the model's alphabet.
+ */
+void fit_scoreboard( MODEL *model, MODEL_SCRATCH *scratch )
+{
+    int new_size;
+    unsigned int *new_scoreboard;
+    SYMBOL_TYPE *new_excluded;
+
+    if ( model->alphabet.size <= scratch->scoreboard_size )
+        return;
+    for ( new_size = ( scratch->scoreboard_size == 0 ) ? 256 : scratch->scoreboard_size ;
+          new_size < model->alphabet.size ;
+          new_size *= 2 )
+        ;
+    new_scoreboard = (unsigned int *) realloc( scratch->scoreboard, new_size * sizeof( unsigned int ) );
+    if ( new_scoreboard == NULL )
+        error_exit( "Error #14: allocating scoreboard!" );
+    memset( new_scoreboard + scratch->scoreboard_size, 0,
+            ( new_size - scratch->scoreboard_size ) * sizeof( unsigned int ) );
+    scratch->scoreboard = new_scoreboard;
+    new_excluded = (SYMBOL_TYPE *) realloc( scratch->excluded, new_size * sizeof( SYMBOL_TYPE ) );
+    if ( new_excluded == NULL )
+        error_exit( "Error #14: allocating scoreboard!" );
+    scratch->excluded = new_excluded;
+    scratch->scoreboard_size = new_size;
+}
+
+/*
+ * exclude_symbol sets a symbol's place on the scoreboard, and adds it
+ * to the list of excluded symbols if it wasn't set already.
+ */
+void exclude_symbol( MODEL_SCRATCH *scratch, SYMBOL_TYPE symbol )
+{
+    if ( !EXCLUDED( scratch, symbol ) )
+    {
+        scratch->scoreboard[ symbol ] = scratch->epoch;
+        scratch->excluded[ scratch->num_excluded++ ] = symbol;
+    }
+}
+
+/*
+ * fit_totals makes sure that the scratch's totals[] can hold num_entries
+ * entries.  totalize_table() needs max_index+3 of them for a node.
+ */
+void fit_totals( MODEL_SCRATCH *scratch, int num_entries )
+{
+    short int *new_totals;
+    int new_size;
+
+    if ( num_entries <= scratch->totals_size )
+        return;
+    for ( new_size = ( scratch->totals_size == 0 ) ? 512 : scratch->totals_size ;
+          new_size < num_entries ;
+          new_size *= 2 )
+        ;
+    new_totals = (short int *) realloc( scratch->totals, new_size * sizeof( short int ) );
+    if ( new_totals == NULL )
+        error_exit( "Error #15: allocating totals!" );
+    scratch->totals = new_totals;
+    scratch->totals_size = new_size;
+}
+
+/*
+ * start_query gets a scratch ready for a query on the given model.
+ * Queries only use the frozen model, so the model is frozen here if it
+ * isn't already.  (That changes the model, so a model that is shared
+ * between threads has to be frozen before they start.)  Orders -2 to 0
+ * are always nodes 0, 1 and 2, so they are filled in here, and the
+ * scoreboard is made big enough for the model's alphabet.
+ */
+void start_query( MODEL *model, MODEL_SCRATCH *scratch )
+{
+    int i;
+
+    if ( model->frozen.image == NULL )
+        freeze_model( model );
+    for ( i = -2 ; i <= 0 ; i++ )
+        scratch->contexts[ i ] = i + 2;
+    fit_scoreboard( model, scratch );
+}
+
+/*
+ * new_context allocates an empty context table of the given order
+ * out of the model's arena.  It comes from the arena's block pools, so
+ * that free_context() can give it back if the table is pruned.
+ */
+CONTEXT *new_context( MODEL *model, int order )
+{
+    CONTEXT *table;
+
+    table = (CONTEXT *) arena_alloc_block( &model->arena, sizeof( CONTEXT ) );
+    if ( table == NULL )
+        return( NULL );
+    table->max_index = -1;
+    table->order = order;
+    model->order_bytes[ order ] += (long) arena_block_size( sizeof( CONTEXT ) );
+    return( table );
+}
+
+/*
+ * resize_table_array grows or shrinks one of the arrays of a
+ * context table from old_count to new_count elements, keeping the
+ * elements that are already there.  The arrays come from the arena's
+ * size-class pools, so growing an array by one element usually
+ * doesn't move it at all.  A new_count of 0 gives the array back and
+ * returns NULL.
+ */
+void *resize_table_array( MODEL *model, CONTEXT *table, void *array, size_t element_size,
+                          int old_count, int new_count )
+{
+    model->order_bytes[ table->order ] +=
+        (long) arena_block_size( element_size * new_count ) -
+        (long) arena_block_size( element_size * old_count );
+    return( arena_realloc_block( &model->arena, array,
+                                 element_size * old_count,
+                                 element_size * new_count ) );
+}
+
+/*
+ * set_table_capacity grows or shrinks the parallel symbols[] and
+ * counts[] arrays of a context table (and its links[] array, if it has
+ * one) so that they have room for new_capacity symbols.  It returns
+ * false if the memory couldn't be allocated.
+ */
+int set_table_capacity( MODEL *model, CONTEXT *table, int new_capacity )
+{
+    table->symbols = (SYMBOL_TYPE __handle *)
+        resize_table_array( model, table, table->symbols, sizeof( SYMBOL_TYPE ),
+                            table->capacity, new_capacity );
+    table->counts = (COUNT_TYPE __handle *)
+        resize_table_array( model, table, table->counts, sizeof( COUNT_TYPE ),
+                            table->capacity, new_capacity );
+    if ( table->links != NULL )
+    {
+        table->links = (LINKS __handle *)
+            resize_table_array( model, table, table->links, sizeof( LINKS ),
+                                table->capacity, new_capacity );
+        model->table_reallocs++;
+    }
+    model->table_reallocs += 2;
+    table->capacity = new_capacity;
+    return( new_capacity == 0 ||
+            ( table->symbols != NULL && table->counts != NULL ) );
+}
+
+/*
+ * grow_table makes sure there is room at the end of a table for one
+ * more symbol (at max_index + 1), giving the table a links[] array
+ * first if need_links is set and it doesn't have one yet.  Tables grow
+ * geometrically (the capacity doubles when it runs out), so adding a
+ * symbol usually doesn't need to touch the arrays at all;
+ * table_reallocs_avoided counts the array reallocations that saves.
+ * It returns false if the memory couldn't be allocated.
+ */
+int grow_table( MODEL *model, CONTEXT *table, int need_links )
+{
+    if ( table->max_index + 1 < table->capacity )
+        model->table_reallocs_avoided += ( table->links != NULL ) ? 3 : 2;
+    else if ( !set_table_capacity( model, table, ( table->capacity == 0 ) ?
+                                          MIN_TABLE_CAPACITY : 2 * table->capacity ) )
+        return( false );
+    if ( need_links && table->links == NULL )
+    {
+        table->links = (LINKS __handle *)
+            resize_table_array( model, table, NULL, sizeof( LINKS ), 0, table->capacity );
+        if ( table->links == NULL )
+            return( false );
+    }
+    return( true );
+}
+
+/*
+ * The next few routines look after the hash index that big context
+ * tables have (see the CONTEXT description in model.h).  hash_cell()
+ * returns the cell of the hash that holds the given symbol, or the
+ * empty cell where it would go if the symbol isn't in the table.
+ * Collisions are handled with linear probing, and the hash is never
+ * allowed to get more than half full, so the probe sequences are short.
+ */
+int hash_cell( CONTEXT *table, SYMBOL_TYPE symbol )
+{
+    return( probe_hash( table->hash, table->hash_size, table->symbols, symbol ) );
+}
+
+/*
+ * probe_hash does the work for hash_cell().  It only needs the arrays,
+ * so the frozen model (which has no CONTEXT tables) can use it too.
+ */
+int probe_hash( const int *hash, int hash_size, const SYMBOL_TYPE *symbols,
+                SYMBOL_TYPE symbol )
+{
+    unsigned int cell;
+    unsigned int mask;
+
+    mask = hash_size - 1;
+    cell = ( ( (unsigned short) symbol * 2654435761u ) >> 16 ) & mask;
+    while ( hash[ cell ] != -1 && symbols[ hash[ cell ] ] != symbol )
+        cell = ( cell + 1 ) & mask;
+    return( (int) cell );
+}
+
+/*
+ * find_symbol_in_table returns the offset of a symbol in a context
+ * table's symbols[] array, or -1 if the symbol isn't in the table.
+ * Big tables are looked up through their hash, small ones searched.
+ */
+int find_symbol_in_table( CONTEXT *table, SYMBOL_TYPE symbol )
+{
+    if ( table->hash == NULL )
+        return( find_symbol16( table->symbols, table->max_index + 1, symbol ) );
+    return( table->hash[ hash_cell( table, symbol ) ] );
+}
+
+/*
+ * build_table_hash throws away a table's hash, if it has one, and then
+ * builds a new one if the table has grown past HASH_THRESHOLD symbols.
+ * The new hash is 4 times the number of symbols, so the table can double
+ * in size before the hash has to be built again.
+ */
+void build_table_hash( MODEL *model, CONTEXT *table )
+{
+    int i;
+    int cell;
+    int new_size;
+
+    resize_table_array( model, table, table->hash, sizeof( int ), table->hash_size, 0 );
+    table->hash = NULL;
+    table->hash_size = 0;
+    if ( table->max_index + 1 <= HASH_THRESHOLD )
+        return;
+    for ( new_size = 1 ; new_size < 4 * ( table->max_index + 1 ) ; new_size *= 2 )
+        ;
+    table->hash = (int __handle *)
+        resize_table_array( model, table, NULL, sizeof( int ), 0, new_size );
+    if ( table->hash == NULL )
+        error_exit( "Error #12: allocating hash index!" );
+    table->hash_size = new_size;
+    for ( i = 0 ; i < new_size ; i++ )
+        table->hash[ i ] = -1;
+    for ( i = 0 ; i <= table->max_index ; i++ )
+    {
+        cell = hash_cell( table, table->symbols[ i ] );
+        if ( table->hash[ cell ] == -1 )	// keep the first copy, like a search would
+            table->hash[ cell ] = i;
+    }
+}
 
-    clear_scoreboard();
+/*
+ * hash_new_symbol is called after a new symbol has been put at the
+ * end of a table (at max_index).  It adds the symbol to the table's hash,
+ * building the hash or making it bigger first if that is needed.
+ */
+void hash_new_symbol( MODEL *model, CONTEXT *table )
+{
+    if ( table->hash == NULL && table->max_index + 1 <= HASH_THRESHOLD )
+        return;
+    if ( 2 * ( table->max_index + 1 ) > table->hash_size )
+        build_table_hash( model, table );
+    else
+        table->hash[ hash_cell( table, table->symbols[ table->max_index ] ) ] =
+            table->max_index;
 }
 /*
  * This is a utility routine used to create new tables when a new
@@ -158,51 +596,35 @@ void initialize_model()
  * to the link table for "BC", and gives "BCD" a back pointer to
  * "CD".  Note that finding the lesser context is a difficult
  * task, and isn't done here.  This routine mainly worries about
- * modifying the stats and links fields in the current context.
+ * modifying the symbol, count and links arrays in the current context.
  */
 
-CONTEXT *allocate_next_order_table( CONTEXT *table,
+CONTEXT *allocate_next_order_table( MODEL *model,
+                                    CONTEXT *table,
                                     SYMBOL_TYPE symbol,
                                     CONTEXT *lesser_context )
 {
     CONTEXT *new_table;
     int i;
-    unsigned int new_size;
     
-    for ( i = 0 ; i <= table->max_index ; i++ )
-        if ( table->stats[ i ].symbol == symbol )
-            break;
-    if ( i > table->max_index )
+    i = find_symbol_in_table( table, symbol );
+    if ( i < 0 )
     {
-        table->max_index++;
-        new_size = sizeof( LINKS );
-        new_size *= table->max_index + 1;
-        if ( table->links == NULL )
-            table->links = (LINKS __handle *) handle_calloc( new_size );
-        else
-            table->links = (LINKS __handle *)
-                 handle_realloc( (char __handle *) table->links, new_size );
-        new_size = sizeof( STATS );
-        new_size *= table->max_index + 1;
-        if ( table->stats == NULL )
-            table->stats = (STATS __handle *) handle_calloc( new_size );
-        else
-            table->stats = (STATS __handle *)
-                handle_realloc( (char __handle *) table->stats, new_size );
-        if ( table->links == NULL )
+        i = table->max_index + 1;
+        if ( !grow_table( model, table, true ) )
             error_exit( "Failure #6: allocating new table" );
-        if ( table->stats == NULL )
-            error_exit( "Failure #7: allocating new table" );
-        table->stats[ i ].symbol = symbol;
-        table->stats[ i ].counts = 0;
+        table->max_index++;
+        table->symbols[ i ] = symbol;
+        table->counts[ i ] = 0;
+        hash_new_symbol( model, table );
     }
-    new_table = (CONTEXT *) calloc( sizeof( CONTEXT ), 1 );
-    alloc_count++;
+    new_table = new_context( model, table->order + 1 );
+    model->alloc_count++;
     if ( new_table == NULL )
         error_exit( "Failure #8: allocating new table" );
-    new_table->max_index = -1;
     table->links[ i ].next = new_table;
     new_table->lesser_context = lesser_context;
+    lesser_context->lesser_refs++;
     return( new_table );
 }
 
@@ -222,14 +644,16 @@ CONTEXT *allocate_next_order_table( CONTEXT *table,
  * 'abracadabra' the counts end up as 'a'=4, 'b'=1, 'r'=1, 'c'=1, 'd'=1
  *
  */
-void update_model( SYMBOL_TYPE symbol )
+void update_model( MODEL *model, SYMBOL_TYPE symbol )
 {
     int local_order;
 
-    if ( current_order < 0 )
+    thaw_model( model );		// the frozen copy won't match the model any more
+
+    if ( model->current_order < 0 )
         local_order = 0;
     else
-        local_order = current_order;
+        local_order = model->current_order;
 
     //Ingrid: Override his code
     local_order = 0;		// Ingrid
@@ -238,15 +662,15 @@ void update_model( SYMBOL_TYPE symbol )
 
     if ( symbol >= 0 )
     {
-        while ( local_order <= max_order )
+        symbol = add_symbol_to_alphabet( model, symbol );
+        while ( local_order <= model->max_order )
         {
             if ( symbol >= 0 )
-                update_table( contexts[ local_order ], symbol );
+                update_table( model, model->contexts[ local_order ], symbol );
             local_order++;
         }
     }
-    current_order = max_order;
-    clear_scoreboard();
+    model->current_order = model->max_order;
 }
 /*
  * This routine is called to update the count for a particular symbol
@@ -255,7 +679,7 @@ void update_model( SYMBOL_TYPE symbol )
  * this is a fairly simple routine, but a couple of complications make
  * things a little messier.  First of all, the given table may not
  * already have the symbol defined in its statistics table.  If it
- * doesn't, the stats table has to grow and have the new guy added
+ * doesn't, the symbol and count arrays have to grow and have the new guy added
  * to it.  Secondly, the symbols are kept in sorted order by count
  * in the table so as that the table can be trimmed during the flush
  * operation.  When this symbol is incremented, it might have to be moved
@@ -263,62 +687,58 @@ void update_model( SYMBOL_TYPE symbol )
  * bytes, if the count reaches 255, the table absolutely must be rescaled
  * to get the counts back down to a reasonable level.
  */
-void update_table( CONTEXT *table, SYMBOL_TYPE symbol )
+void update_table( MODEL *model, CONTEXT *table, SYMBOL_TYPE symbol )
 {
     int i;
     int index;
     SYMBOL_TYPE temp;
     CONTEXT *temp_ptr;
-    unsigned int new_size;
+    int cell_index, cell_i;		// hash cells of the two symbols being swapped
     
 /*
  * First, find the symbol in the appropriate context table.  The first
  * symbol in the table is the most active, so start there.
  */
-    index = 0;
-    while ( index <= table->max_index &&
-            table->stats[index].symbol != symbol )
-        index++;
-    if ( index > table->max_index )
+    index = find_symbol_in_table( table, symbol );
+    if ( index < 0 )
     {
+        index = table->max_index + 1;
+        if ( !grow_table( model, table, model->current_order < model->max_order ) )
+            error_exit( "Error #9: reallocating table space!" );
         table->max_index++;
-        new_size = sizeof( LINKS );
-        new_size *= table->max_index + 1;
-        if ( current_order < max_order )
-        {
-            if ( table->max_index == 0 )
-                table->links = (LINKS __handle *) handle_calloc( new_size );
-            else
-                table->links = (LINKS __handle *)
-                   handle_realloc( (char __handle *) table->links, new_size );
-            if ( table->links == NULL )
-                error_exit( "Error #9: reallocating table space!" );
+        if ( table->links != NULL )
             table->links[ index ].next = NULL;
-        }
-        new_size = sizeof( STATS );
-        new_size *= table->max_index + 1;
-        if (table->max_index==0)
-            table->stats = (STATS __handle *) handle_calloc( new_size );
-        else
-            table->stats = (STATS __handle *)
-                handle_realloc( (char __handle *) table->stats, new_size );
-        if ( table->stats == NULL )
-            error_exit( "Error #10: reallocating table space!" );
-        table->stats[ index ].symbol = symbol;
-        table->stats[ index ].counts = 0;
+        table->symbols[ index ] = symbol;
+        table->counts[ index ] = 0;
+        hash_new_symbol( model, table );
     }
+/*
+ * The counts are only 16 bits, so a count that is about to overflow
+ * means the table has to be scaled down first.  (Halving the counts
+ * this way keeps them in the same order, so index is still good.)
+ */
+    if ( table->counts[ index ] == MAX_COUNT )
+        rescale_saturated_table( model, table );
 /*
  * Now I move the symbol to the front of its list.
  */
     i = index;
     while ( i > 0 &&
-            table->stats[ index ].counts == table->stats[ i-1 ].counts )
+            table->counts[ index ] == table->counts[ i-1 ] )
         i--;
     if ( i != index )
     {
-        temp = table->stats[ index ].symbol;
-        table->stats[ index ].symbol = table->stats[ i ].symbol;
-        table->stats[ i ].symbol = temp;
+        if ( table->hash != NULL )
+        {
+            // The two symbols trade places, so their hash cells trade offsets.
+            cell_index = hash_cell( table, table->symbols[ index ] );
+            cell_i = hash_cell( table, table->symbols[ i ] );
+            table->hash[ cell_index ] = i;
+            table->hash[ cell_i ] = index;
+        }
+        temp = table->symbols[ index ];
+        table->symbols[ index ] = table->symbols[ i ];
+        table->symbols[ i ] = temp;
         if ( table->links != NULL )
         {
             temp_ptr = table->links[ index ].next;
@@ -330,9 +750,28 @@ void update_table( CONTEXT *table, SYMBOL_TYPE symbol )
 /*
  * The switch has been performed, now I can update the counts
  */
-    table->stats[ index ].counts++;
-    //if ( table->stats[ index ].counts == 255 )	// Ingrid: removed this - it sets level 0 counts to 0
+    table->counts[ index ]++;
+    //if ( table->counts[ index ] == 255 )	// Ingrid: removed this - it sets level 0 counts to 0
         //rescale_table( table );    // HERE these two lines were commented out until I hit a large file.
+        // (update_table now calls rescale_saturated_table() instead, see above)
+}
+
+/*
+ * rescale_saturated_table is called by update_table() when one of a
+ * table's counts has reached MAX_COUNT.  It halves every count in the
+ * table, like rescale_table(), but rounds up, so a symbol that has been
+ * seen stays seen.  (Rounding down is what broke the level 0 counts
+ * when the counts were bytes: the symbols seen once dropped to a count of
+ * 0, which makes them invisible to the rest of the model.)  Nothing is
+ * trimmed and the order of the symbols doesn't change.
+ */
+void rescale_saturated_table( MODEL *model, CONTEXT *table )
+{
+    int i;
+
+    for ( i = 0 ; i <= table->max_index ; i++ )
+        table->counts[ i ] = ( table->counts[ i ] + 1 ) / 2;
+    model->saturated_rescales++;
 }
 
 /*********************************************
@@ -340,12 +779,12 @@ void update_table( CONTEXT *table, SYMBOL_TYPE symbol )
  *
  * Used for during training.
  *
- * INPUTS: None
- * OUTPUTS: current_order set to 0
+ * INPUTS: the model being trained
+ * OUTPUTS: the model's current_order set to 0
  * RETURNS: void
  ************************************************/
-void clear_current_order(){
-	current_order = 0;
+void clear_current_order( MODEL *model ){
+	model->current_order = 0;
 	return;
 }
 /*
@@ -362,33 +801,37 @@ void clear_current_order(){
  * the order -2 character set, which consists of negative numbers
  * instead of unsigned chars.  This insures that no match will every
  * be found for the EOF or FLUSH symbols in any "normal" table.
+ * Unless the node has been rescaled, frozen_interval() can work the
+ * counts out from the node's cumulative counts instead.
  */
-int convert_int_to_symbol( SYMBOL_TYPE c, SYMBOL *s )
+int convert_int_to_symbol( MODEL *model, MODEL_SCRATCH *scratch, SYMBOL_TYPE c, SYMBOL *s )
 {
     int i;
-    CONTEXT *table;
+    int n;
+    FROZEN_MODEL *f = &model->frozen;
 
-    table = contexts[ current_order ];
-    totalize_table( table );
-    s->scale = totals[ 0 ];
-    if ( current_order == -2 )
+    n = scratch->contexts[ scratch->current_order ];
+    if ( scratch->current_order == -2 )
         c = -c;
-    for ( i = 0 ; i <= table->max_index ; i++ )
+    else
+        c = symbol_id( model, c );
+    if ( f->nodes[ n ].scale_shift == 0 )
+        return( frozen_interval( model, scratch, n, c, s ) );
+    totalize_table( model, scratch, n );
+    s->scale = scratch->totals[ 0 ];
+    i = frozen_find( f, n, c );
+    if ( i >= 0 && i <= f->nodes[ n ].scaled_max_index &&
+         FROZEN_COUNT( f, n, i ) != 0 )
     {
-        if ( c == table->stats[ i ].symbol )
-        {
-            if ( table->stats[ i ].counts == 0 )
-                break;
-            s->low_count = totals[ i+2 ];
-            s->high_count = totals[ i+1 ];
-            return( 0 );
-        }
+        s->low_count = scratch->totals[ i+2 ];
+        s->high_count = scratch->totals[ i+1 ];
+        return( 0 );
     }
 
-    s->low_count = totals[ 1 ];
-    s->high_count = totals[ 0 ];
+    s->low_count = scratch->totals[ 1 ];
+    s->high_count = scratch->totals[ 0 ];
 
-    current_order--;
+    scratch->current_order--;
     return( 1 );
 }
 
@@ -399,13 +842,10 @@ int convert_int_to_symbol( SYMBOL_TYPE c, SYMBOL *s )
  * table, then building the totals table.  Once that is done, the
  * cumulative total table has the symbol scale at element 0.
  */
-void get_symbol_scale( SYMBOL *s )
+void get_symbol_scale( MODEL *model, MODEL_SCRATCH *scratch, SYMBOL *s )
 {
-    CONTEXT *table;
-
-    table = contexts[ current_order ];
-    totalize_table( table );
-    s->scale = totals[ 0 ];
+    totalize_table( model, scratch, scratch->contexts[ scratch->current_order ] );
+    s->scale = scratch->totals[ 0 ];
 }
 
 /*
@@ -438,9 +878,9 @@ int convert_symbol_to_int( int count, SYMBOL *s)
         return( ESCAPE );
     }
     if ( current_order < -1 )
-        return( (int) -table->stats[ c-2 ].symbol );
+        return( (int) -table->symbols[ c-2 ] );
     else
-        return( table->stats[ c-2 ].symbol );
+        return( table->symbols[ c-2 ] );
 }
 ************************************************/
 
@@ -458,17 +898,21 @@ int convert_symbol_to_int( int count, SYMBOL *s)
  * the pointers to "CD" and "C".  The hard work was done in
  * shift_to_context().
  */
-void add_character_to_model( SYMBOL_TYPE c )
+void add_character_to_model( MODEL *model, SYMBOL_TYPE c )
 {
     int i;
     
-    if ( max_order < 0 || c < 0 )
+    if ( model->max_order < 0 || c < 0 )
        return;
-    contexts[ max_order ] =
-       shift_to_next_context( contexts[ max_order ],
-                              c, max_order );
-    for ( i = max_order-1 ; i > 0 ; i-- )
-        contexts[ i ] = contexts[ i+1 ]->lesser_context;
+    thaw_model( model );
+    c = add_symbol_to_alphabet( model, c );
+    model->contexts[ model->max_order ] =
+       shift_to_next_context( model, model->contexts[ model->max_order ],
+                              c, model->max_order );
+    for ( i = model->max_order-1 ; i > 0 ; i-- )
+        model->contexts[ i ] = model->contexts[ i+1 ]->lesser_context;
+    if ( model->memory_budget > 0 && model->arena.in_use > model->prune_limit )
+        prune_model( model );
 }
 
 /*
@@ -497,7 +941,7 @@ void add_character_to_model( SYMBOL_TYPE c )
  * the most complicated part of the modeling program, but it is
  * necessary for performance reasons.
  */
-CONTEXT *shift_to_next_context( CONTEXT *table, SYMBOL_TYPE c, int order)
+CONTEXT *shift_to_next_context( MODEL *model, CONTEXT *table, SYMBOL_TYPE c, int order)
 {
     int i;
     CONTEXT *new_lesser;
@@ -514,13 +958,9 @@ CONTEXT *shift_to_next_context( CONTEXT *table, SYMBOL_TYPE c, int order)
     table = table->lesser_context;
     if ( order == 0 )
         return( table->links[ 0 ].next );
-    for ( i = 0 ; i <= table->max_index ; i++ )
-        if ( table->stats[ i ].symbol == c )  {
-            if ( table->links[ i ].next != NULL )
-                return( table->links[ i ].next );
-            else
-                break;
-        }
+    i = find_symbol_in_table( table, c );
+    if ( i >= 0 && table->links[ i ].next != NULL )
+        return( table->links[ i ].next );
 /*
  * If I get here, it means the new context did not exist.  I have to
  * create the new context, add a link to it here, and add the backwards
@@ -529,12 +969,12 @@ CONTEXT *shift_to_next_context( CONTEXT *table, SYMBOL_TYPE c, int order)
  * creating the new back pointer isn't easy, I duck my responsibility
  * and recurse to myself in order to pick it up.
  */
-    new_lesser = shift_to_next_context( table, c, order-1 );
+    new_lesser = shift_to_next_context( model, table, c, order-1 );
 /*
  * Now that I have the back pointer for this table, I can make a call
  * to a utility to allocate the new table.
  */
-    table = allocate_next_order_table( table, c, new_lesser );
+    table = allocate_next_order_table( model, table, c, new_lesser );
     return( table );
 }
 
@@ -548,111 +988,259 @@ CONTEXT *shift_to_next_context( CONTEXT *table, SYMBOL_TYPE c, int order)
  * want to rescale all tables in order to give more weight to newer
  * statistics.  All this routine does is divide each count by 2.
  * If any counts drop to 0, the counters can be removed from the
- * stats table, but only if this is a leaf context.  Otherwise, we
+ * symbol and count arrays, but only if this is a leaf context.  Otherwise, we
  * might cut a link to a higher order table.
  */
-void rescale_table( CONTEXT *table )
+void rescale_table( MODEL *model, CONTEXT *table )
 {
     int i;
 
     if ( table->max_index == -1 )
         return;
     for ( i = 0 ; i <= table->max_index ; i++ )
-        table->stats[ i ].counts /= 2;
-    if ( table->stats[ table->max_index ].counts == 0 &&
+        table->counts[ i ] /= 2;
+    if ( table->counts[ table->max_index ] == 0 &&
          table->links == NULL )
     {
-        while ( table->stats[ table->max_index ].counts == 0 &&
+        while ( table->counts[ table->max_index ] == 0 &&
                 table->max_index >= 0 )
             table->max_index--;
-        if ( table->max_index == -1 )
-        {
-            handle_free( (char __handle *) table->stats );
-            table->stats = NULL;
-        }
-        else
-        {
-            table->stats = (STATS __handle *)
-                handle_realloc( (char __handle *) table->stats,
-                                 sizeof( STATS ) * ( table->max_index + 1 ) );
-            if ( table->stats == NULL )
-                error_exit( "Error #11: reallocating stats space!" );
-        }
+        if ( !set_table_capacity( model, table, table->max_index + 1 ) )	// shrink to fit
+            error_exit( "Error #11: reallocating stats space!" );
+        build_table_hash( model, table );	// the hash may point past the end now
     }
 }
 
 /*
  * This routine has the job of creating a cumulative totals table for
- * a given context.  The cumulative low and high for symbol c are going to
- * be stored in totals[c+2] and totals[c+1].  Locations 0 and 1 are
- * reserved for the special ESCAPE symbol.  The ESCAPE symbol
- * count is calculated dynamically, and changes based on what the
- * current context looks like.  Note also that this routine ignores
+ * a given context (node n of the frozen model).  The cumulative low
+ * and high for symbol c are going to be stored in totals[c+2] and
+ * totals[c+1].  Locations 0 and 1 are reserved for the special ESCAPE
+ * symbol.  The ESCAPE symbol count is calculated dynamically, and
+ * changes based on what the current context looks like.  Note also that this routine ignores
  * any counts for symbols that have already showed up in the scoreboard,
  * and it adds all new symbols found here to the scoreboard.  This
  * allows us to exclude counts of symbols that have already appeared in
  * higher order contexts, improving compression quite a bit.
  */
-void totalize_table( CONTEXT *table )
+void totalize_table( MODEL *model, MODEL_SCRATCH *scratch, int n )
 {
+    FROZEN_MODEL *f = &model->frozen;
+    SYMBOL_TYPE *symbols = f->symbols + f->nodes[ n ].first;
+    int max_index = f->nodes[ n ].scaled_max_index;
+    short int *totals;
     int i;
     unsigned char max;
 //    int num_excluded_symbols = 0;	// Ingrid - count excluded symbols
 
-    for ( ; ; )
+    fit_totals( scratch, max_index + 3 );
+    totals = scratch->totals;
+    max = 0;
+    i = max_index + 2;
+    totals[ i ] = 0;
+    for ( ; i > 1 ; i-- )
     {
-        max = 0;
-        i = table->max_index + 2;
-        totals[ i ] = 0;
-        for ( ; i > 1 ; i-- )
-        {
-            totals[ i-1 ] = totals[ i ];
-            if ( table->stats[ i-2 ].counts )
-                if ( ( current_order == -2 ) ||
-                     scoreboard[ table->stats[ i-2 ].symbol - LOWEST_SYMBOL ] == 0 )
-                     totals[ i-1 ] += table->stats[ i-2 ].counts;
-            if ( table->stats[ i-2 ].counts > max )
-                max = table->stats[ i-2 ].counts;
-        }
+        totals[ i-1 ] = totals[ i ];
+        if ( FROZEN_COUNT( f, n, i-2 ) )
+            if ( ( scratch->current_order < 0 ) ||		// was == -2, but the null table isn't in the alphabet either
+                 !EXCLUDED( scratch, symbols[ i-2 ] ) )
+                 totals[ i-1 ] += FROZEN_COUNT( f, n, i-2 );
+        if ( FROZEN_COUNT( f, n, i-2 ) > max )
+            max = FROZEN_COUNT( f, n, i-2 );
+    }
 /*
  * Here is where the escape calculation needs to take place.
  */
 
-        if ( max == 0 )
-            totals[ 0 ] = 1;
-        else
-        {
-        	/* Ingrid - I commented out this code because I'm not sure what he's doing!
-        	 * (and it gives me incorrect restults for logloss numbers)
-        	 *
-*            totals[ 0 ] = (short int) ( 256 - table->max_index );
-*            totals[ 0 ] *= table->max_index;
-*            totals[ 0 ] /= 256;
-*            totals[ 0 ] /= max;
-*            totals[ 0 ]++;
-*            totals[ 0 ] += totals[ 1 ];
+    if ( max == 0 )
+        totals[ 0 ] = 1;
+    else
+    {
+    	/* Ingrid - I commented out this code because I'm not sure what he's doing!
+    	 * (and it gives me incorrect restults for logloss numbers)
+    	 *
+*        totals[ 0 ] = (short int) ( 256 - table->max_index );
+*        totals[ 0 ] *= table->max_index;
+*        totals[ 0 ] /= 256;
+*        totals[ 0 ] /= max;
+*        totals[ 0 ]++;
+*        totals[ 0 ] += totals[ 1 ];
 ********    end of original code	*/
-        	/* Start of Ingrid's code */
-        	if (current_order == 0)
-        		totals[0] = totals[1] + table->max_index;
-        	else
-           		totals[0] = totals[1] + table->max_index + 1;
-        	/* End of Ingrid's changes  */
-        }
-        if ( totals[ 0 ] < MAXIMUM_SCALE )
-            break;
-        rescale_table( table );			// This should never get called. (IT will print a message if it does.)
+    	/* Start of Ingrid's code */
+    	if (scratch->current_order == 0)
+    		totals[0] = totals[1] + max_index;
+    	else
+       		totals[0] = totals[1] + max_index + 1;
+    	/* End of Ingrid's changes  */
     }
-    for ( i = 0 ; i < table->max_index ; i++ )		// Ingrid - changed to <= (was <)
+/*
+ * The table used to be rescaled here if totals[ 0 ] came to MAXIMUM_SCALE
+ * or more.  A node's counts are already rescaled as far as they need to
+ * be (see scale_frozen_node()), so that never happens.
+ */
+    for ( i = 0 ; i < max_index ; i++ )		// Ingrid - changed to <= (was <)
     		// Careful: if it runs through the whole loop it will cause an ACCESS_VIOLATION
-    	if (table->stats[i].counts != 0) {
-    		// This is a bug fix hack -- don't know why we can sometimes get a table where this is not true:
-    		if (table->stats[i].symbol >= LOWEST_SYMBOL)
-    			scoreboard[ table->stats[ i ].symbol - LOWEST_SYMBOL ] = 1;
-            printf("i=%d, max_index=%d, brackets=%d, max=%d\n", i, table->max_index, table->stats[ i ].symbol - LOWEST_SYMBOL, RANGE_OF_SYMBOLS);
+    	if (FROZEN_COUNT( f, n, i ) != 0) {
+    		// Only tables of order 0 and up hold symbol ids.  (This used to be a
+    		// 'symbol >= LOWEST_SYMBOL' hack that kept the null and control tables out.)
+    		if (scratch->current_order >= 0)
+    			exclude_symbol( scratch, symbols[ i ] );
     		}	
 }
 
+/*
+ * shrink_model trims every table's arrays down to the size of the table
+ * (see grow_table() for why they can be bigger).  It is meant to be
+ * called once training is done.
+ */
+void shrink_model( MODEL *model )
+{
+    shrink_tables( model, model->contexts[ 0 ] );
+}
+
+/*
+ * shrink_tables does the work for shrink_model(): it shrinks the
+ * given table, and then all of the tables that it links to.
+ */
+void shrink_tables( MODEL *model, CONTEXT *table )
+{
+    int i;
+
+    if ( table->links != NULL )
+        for ( i = 0 ; i <= table->max_index ; i++ )
+            if ( table->links[ i ].next != NULL )
+                shrink_tables( model, table->links[ i ].next );
+    if ( table->capacity > table->max_index + 1 &&
+         !set_table_capacity( model, table, table->max_index + 1 ) )
+        error_exit( "Error #11: reallocating stats space!" );
+}
+
+/*
+ * set_memory_budget limits the memory that the model can use while it
+ * is being trained to the given number of bytes (0 means no limit).
+ * It should be called before the model is trained.
+ */
+void set_memory_budget( MODEL *model, long bytes )
+{
+    model->memory_budget = ( bytes > 0 ) ? bytes : 0;
+    model->prune_limit = (size_t) model->memory_budget;
+}
+
+/*
+ * prune_model is called by add_character_to_model() when the model has
+ * gone over its memory budget.  It throws away the context tables that
+ * are worth the least, until the model is back down to 3/4 of the budget
+ * (so that it doesn't have to prune again after the next few symbols).
+ * A table is worth as much as the number of times its context has been
+ * seen, which is the count of its symbol in its parent table.  The
+ * first pass throws away the tables whose contexts were only seen once,
+ * and the threshold doubles each time a pass can't find anything more
+ * to throw away.
+ *
+ * Only tables that no other table depends on can go (see
+ * can_prune_table()), so it is always the high order tables that are
+ * pruned first, and the order 1 tables are kept whatever the budget.  The parent keeps the symbol and its count; only the
+ * link to the table is cleared, and the table comes back (empty) if the
+ * context is seen again.  If the budget is too small for even the
+ * tables that can't be pruned, the next prune is put off until the model
+ * has grown by another 1/8th of the budget, so training isn't stuck
+ * pruning after every symbol.
+ */
+void prune_model( MODEL *model )
+{
+    size_t low_water;
+    int threshold;
+    long pruned;
+
+    thaw_model( model );
+    low_water = (size_t) ( model->memory_budget - model->memory_budget / 4 );
+    threshold = 1;
+    while ( model->arena.in_use > low_water && threshold <= MAX_COUNT )
+    {
+        pruned = prune_tables( model, model->contexts[ 0 ], threshold );
+        if ( pruned == 0 )
+            threshold *= 2;
+        model->tables_pruned += pruned;
+    }
+    model->prune_limit = (size_t) model->memory_budget;
+    if ( model->arena.in_use + (size_t) ( model->memory_budget / 8 ) > model->prune_limit )
+        model->prune_limit = model->arena.in_use + (size_t) ( model->memory_budget / 8 );
+    model->prune_runs++;
+}
+
+/*
+ * prune_tables does the work for prune_model().  It prunes below each of
+ * the tables that the given table links to, and then throws away the
+ * linked tables themselves if they can go and their contexts haven't
+ * been seen more than threshold times.  It returns the number of tables
+ * it threw away.
+ */
+long prune_tables( MODEL *model, CONTEXT *table, int threshold )
+{
+    int i;
+    long pruned;
+    CONTEXT *next;
+
+    pruned = 0;
+    if ( table->links == NULL )
+        return( 0 );
+    for ( i = 0 ; i <= table->max_index ; i++ )
+    {
+        next = table->links[ i ].next;
+        if ( next == NULL )
+            continue;
+        pruned += prune_tables( model, next, threshold );
+        if ( table->counts[ i ] <= threshold && can_prune_table( model, next ) )
+        {
+            free_context( model, next );
+            table->links[ i ].next = NULL;
+            pruned++;
+        }
+    }
+    return( pruned );
+}
+
+/*
+ * can_prune_table decides whether a table can be thrown away without
+ * breaking the model.  The tables of order 1 and below are never pruned:
+ * the order 0 table keeps every symbol anyway, and without its order 1
+ * table a symbol's context would escape straight past order 0 when the
+ * model is queried.  Neither are the current contexts, since
+ * add_character_to_model() is going to use them for the next symbol.
+ * Otherwise, a table can go once it doesn't link to any tables of its
+ * own, and no other table uses it as its lesser context.
+ */
+int can_prune_table( MODEL *model, CONTEXT *table )
+{
+    int i;
+
+    if ( table->order <= 1 || table->lesser_refs != 0 ||
+         table == model->contexts[ table->order ] )
+        return( false );
+    if ( table->links != NULL )
+        for ( i = 0 ; i <= table->max_index ; i++ )
+            if ( table->links[ i ].next != NULL )
+                return( false );
+    return( true );
+}
+
+/*
+ * free_context gives a table, and all of its arrays, back to the arena.
+ * The caller has to clear the link to it.
+ */
+void free_context( MODEL *model, CONTEXT *table )
+{
+    table->lesser_context->lesser_refs--;
+    resize_table_array( model, table, table->symbols, sizeof( SYMBOL_TYPE ), table->capacity, 0 );
+    resize_table_array( model, table, table->counts, sizeof( COUNT_TYPE ), table->capacity, 0 );
+    if ( table->links != NULL )
+        resize_table_array( model, table, table->links, sizeof( LINKS ), table->capacity, 0 );
+    resize_table_array( model, table, table->hash, sizeof( int ), table->hash_size, 0 );
+    model->order_bytes[ table->order ] -= (long) arena_block_size( sizeof( CONTEXT ) );
+    arena_free_block( &model->arena, table, sizeof( CONTEXT ) );
+    model->alloc_count--;
+}
+
 /*
  * This routine is called when the entire model is to be flushed.
  * This is done in an attempt to improve the compression ratio by
@@ -661,15 +1249,15 @@ void totalize_table( CONTEXT *table )
  * rescale every table in its list of links.  The table itself
  * is then rescaled.
  */
-void recursive_flush( CONTEXT *table )
+void recursive_flush( MODEL *model, CONTEXT *table )
 {
     int i;
     
     if ( table->links != NULL )
         for ( i = 0 ; i <= table->max_index ; i++ )
             if ( table->links[ i ].next != NULL )
-                recursive_flush( table->links[ i ].next );
-    rescale_table( table );
+                recursive_flush( model, table->links[ i ].next );
+    rescale_table( model, table );
 }
 
 /*
@@ -677,9 +1265,10 @@ void recursive_flush( CONTEXT *table )
  * by calling the recursive flush routine starting at the order 0
  * table.
  */
-void flush_model()
+void flush_model( MODEL *model )
 {
-    recursive_flush( contexts[ 0 ] );
+    thaw_model( model );
+    recursive_flush( model, model->contexts[ 0 ] );
 }
 
 void error_exit( char *message)
@@ -696,7 +1285,7 @@ void error_exit( char *message)
  * verbose = TRUE to printf verbose output, rather than comma-sep values.
  *
  */
-void count_model(int research_question, int verbose)
+void count_model( MODEL *model, int research_question, int verbose)
 {
 	int i, min, max;
 	float total;
@@ -708,7 +1297,7 @@ void count_model(int research_question, int verbose)
 	int multimodal;		// true if number of children has more than one mode.
 #endif	
 	// count tables and children for this research_question.
-	recursive_count(0, contexts[0], research_question, verbose);
+	recursive_count( model, 0, model->contexts[0], research_question, verbose);
 	//printf("num_context_tables = %d\n", num_context_tables);
 	//for (i=0; i <= num_context_tables; i++)
 		//printf("num_children[%d]=%d\n", i, num_children[i]);
@@ -832,9 +1421,9 @@ void count_model(int research_question, int verbose)
  *
  * This routine is called when the entire model is to be printed.
  */
-void print_model()
+void print_model( MODEL *model )
 {
-    recursive_print( 0, contexts[ 0 ] );
+    recursive_print( model, 0, model->contexts[ 0 ] );
 }
 /*
  * recursive_count
@@ -847,7 +1436,7 @@ void print_model()
  * NOte that this routine assumes only 1st order tables
  * and a binboxstrings representation.
  */
-void recursive_count(int depth,  CONTEXT *table, int research_question, int verbose )
+void recursive_count( MODEL *model, int depth,  CONTEXT *table, int research_question, int verbose )
 {
     int i, type;
 	char tabs[] = "\t\t\t\t";
@@ -877,22 +1466,22 @@ void recursive_count(int depth,  CONTEXT *table, int research_question, int verb
 
 	for (i=0; i <= table->max_index; i++)  
 	{
-		type = get_binboxstring_type( table->stats[i].symbol);
+		type = get_binboxstring_type( alphabet_code( &model->alphabet, table->symbols[i]));
 		/* If this table has links, print them */
-    	if (( table->links != NULL && depth < max_order ) &&
+    	if (( table->links != NULL && table->links[i].next != NULL && depth < model->max_order ) &&
     		((research_question == WHEN && type == LOC) ||
     		 (research_question == WHERE && type == STRT))){
     		if (verbose)  {
     			if (type == STRT)
     			{
-    				get_hhmm_from_code(table->stats[i].symbol, str_time );
+    				get_hhmm_from_code(alphabet_code( &model->alphabet, table->symbols[i]), str_time );
     				printf("%sContext %s %s: ", tabs, str_time, get_str_mappings(type));
     			}
     			else
-    				printf("%sContext 0x%04x %s: ", tabs, table->stats[i].symbol, get_str_mappings(type));
+    				printf("%sContext 0x%04x %s: ", tabs, alphabet_code( &model->alphabet, table->symbols[i]), get_str_mappings(type));
     		}
    			num_context_tables++;
-    		recursive_count( depth+1, table->links[i].next, research_question, verbose);
+    		recursive_count( model, depth+1, table->links[i].next, research_question, verbose);
     	}
 	}
 	//printf("num_context_tables=%d\n", num_context_tables);
@@ -907,7 +1496,7 @@ void recursive_count(int depth,  CONTEXT *table, int research_question, int verb
  * 		   table = points to the table to print
  *
  */
-void recursive_print(int depth,  CONTEXT *table )
+void recursive_print( MODEL *model, int depth,  CONTEXT *table )
 {
     int i;
 	char tabs[] = "\t\t\t\t";
@@ -922,12 +1511,12 @@ void recursive_print(int depth,  CONTEXT *table )
 	for (i=0; i <= table->max_index; i++)  {
 		printf("%sSymbol: 0x%04x, counts: %d\n",
 			tabs,
-			table->stats[i].symbol,
-			table->stats[i].counts);
+			alphabet_code( &model->alphabet, table->symbols[i]),
+			table->counts[i]);
 
 		/* If this table has links, print them */
-    	if ( table->links != NULL && depth < max_order )
-			recursive_print( depth+1, table->links[i].next);
+    	if ( table->links != NULL && table->links[i].next != NULL && depth < model->max_order )
+			recursive_print( model, depth+1, table->links[i].next);
 		}
 }
 /**************************
@@ -944,10 +1533,11 @@ void recursive_print(int depth,  CONTEXT *table )
 ** RETURNS: probability (as a number between 0 and 1)
 **  Note that ESCAPE probability is NOT included.
 */
-float probability( SYMBOL_TYPE c, STRING16 * context_string, char verbose)
+float probability( MODEL *model, MODEL_SCRATCH *scratch, SYMBOL_TYPE c, STRING16 * context_string, char verbose)
 {
 	int i;
-	CONTEXT *table;
+	FROZEN_MODEL *f = &model->frozen;
+	int n;			// node of the context
 	int prob_numerator = 1, prob_denominator = 1;
 #ifdef TOOK_THIS_OUT_TO_BE_CONSISTENT
 	int local_order=0;
@@ -955,27 +1545,25 @@ float probability( SYMBOL_TYPE c, STRING16 * context_string, char verbose)
 	float fl_prob;		// final probability calculation
 	int done = false;
 
+	start_query( model, scratch);
 	while (!done){
 		// Traverse the tree, trying to find the context string.
-		if (current_order >= 0)
-			traverse_tree(context_string);
-		table = contexts[current_order];	// point to best context
+		if (scratch->current_order >= 0)
+			traverse_tree( model, scratch, context_string);
+		n = scratch->contexts[scratch->current_order];	// point to best context
 
 		// now find the character we want the probability of
-		i = 0;
-		while (i <= table->max_index &&
-				table->stats[i].symbol != c)
-			i++;
+		i = frozen_find( f, n, symbol_id( model, c));
 
-		if (i > table->max_index)	{
+		if (i < 0)	{
 			// If you got here, it means that you found the context string (or part of it)
 			// in the table, but can't find the test character c anywhere.  You can try a shorter
 			// context or stop at level -1.
-			if (current_order > 0)
+			if (scratch->current_order > 0)
 				shorten_string16( context_string );	// remove the first character from the context string and try again
 			else {
 				// This character wasn't found in the training data, so fall back to level -1
-				current_order = -1;
+				scratch->current_order = -1;
 				}
 			}
 		else
@@ -984,21 +1572,20 @@ float probability( SYMBOL_TYPE c, STRING16 * context_string, char verbose)
 	// Brute force calculation of the probability
 
 	// Numerator = counts for this character c
-	prob_numerator = table->stats[i].counts;
+	prob_numerator = f->counts[ f->nodes[n].first + i ];
 
 #ifdef TOOK_THIS_OUT_TO_BE_CONSISTENT
 	// Demoninator has two parts, it's the sum of all the counts + the number of elements in the table
 	// (His context[0] table has an extra entry in it, so don't add the extra '1'
 	if (local_order == 0)
-		prob_denominator = table->max_index;
+		prob_denominator = f->nodes[n].max_index;
 	else
-		prob_denominator = table->max_index + 1;	// this is the number of elements in the table.
+		prob_denominator = f->nodes[n].max_index + 1;	// this is the number of elements in the table.
 #else
 	prob_denominator = 0;
 #endif
 	
-	for (i=0; i <= table->max_index; i++)
-		prob_denominator += table->stats[i].counts;
+	prob_denominator += frozen_total( f, n);
 
 	fl_prob = (float) prob_numerator/(float) prob_denominator;
 	printf("Pr( 0x%04x | %s) = %d/%d = %f\n", c, format_string16(context_string),
@@ -1023,11 +1610,11 @@ float probability( SYMBOL_TYPE c, STRING16 * context_string, char verbose)
 ** OUTPUTS: symbol is filled in with interval information
 ** RETURNS:
 ********************************************************************/
-unsigned char predict_next( STRING16 * context_string, STRUCT_PREDICTION * results)
+unsigned char predict_next( MODEL *model, MODEL_SCRATCH *scratch, STRING16 * context_string, STRUCT_PREDICTION * results)
 {
+#ifdef DEBUG_MODEL
 	int i;
-	CONTEXT *table;
-	int max_counts;		// maximum value for 'counts' found
+#endif
 
 	// Traverse the tree, trying to find the context string.
 	// If the entire context string can't be found,
@@ -1037,61 +1624,12 @@ unsigned char predict_next( STRING16 * context_string, STRUCT_PREDICTION * resul
 	//	(example: context[1] points to the "a" context and
 	//  context[2] points to the "ab" context.
 	//  local_order is set to the depth where the context was found
-	traverse_tree( context_string);
-	if (current_order < 0)		// if the last char wasn't found at all, don't back down all the way to -1
-		current_order = 0;
-	table = contexts[ current_order ];
-
-	/* At this point, we have traversed the tree and we are
-	 * pointing to the best context that we can find.
-	 * table points to this context table
-	 * local_order is the depth (or order) of this model
-	 */
-//	strcpy( results->context_string_used, &context_string[start_of_string]);
-	results->depth = current_order;
-
-	/* Find the symbols with the highest probability, given
-	 * this context.
-	 * Fortunately, this implementation of the model stores
-	 * the symbols in sorted order, so we can start at the
-	 * top and stop when we hit a max count or when the
-	 * counts (used to calc the probability) diminish.
-	 */
-
-	// Demoninator has two parts, it's the sum of all the counts + the number of elements in the table
-	// (His context[0] table has an extra entry in it, so don't add the extra '1'
-#ifdef REMOVED_FOR_CONFIDENCE_LEVEL_TESTING
-	if (current_order == 0)
-		results->prob_denominator = table->max_index;
-	else
-		results->prob_denominator = table->max_index + 1;	// this is the number of elements in the table.
-#else
-		results->prob_denominator = 0;				// initialize denominator
-#endif
-	max_counts = table->stats[0].counts;	// max value for 'counts' is in first element
-	// go through the table and store all symbols with the same value for 'counts' as the
-	// first element.
-	
-	// the clause below [table->stats[i].counts== max_counts] is causing the model to only 
-	// return the most popular predictions, not all of the predictions.
-	for (i=0;
-		i <= table->max_index &&
-		//table->stats[i].counts == max_counts &&				// comment this out to return ALL predictions instead of just the most popular.
-		i < MAX_NUM_PREDICTIONS;
-		i++)	{
-		// store information about this symbol
-		results->sym[i].symbol = table->stats[i].symbol;
-		results->sym[i].prob_numerator = table->stats[i].counts;
-		results->prob_denominator += table->stats[i].counts;
-		}
-	results->num_predictions = i;
-
-	// Add up the rest of the counts in the table for the denominator
-	for ( ; i <= table->max_index; i++)	{
-		results->prob_denominator += table->stats[i].counts;
-		}
-#ifdef DEBUG_MODEL
-	/* print results
+	traverse_tree( model, scratch, context_string);
+	if (scratch->current_order < 0)		// if the last char wasn't found at all, don't back down all the way to -1
+		scratch->current_order = 0;
+	report_prediction( model, scratch, results, MAX_NUM_PREDICTIONS, ALL_OF_THE_MASS);
+#ifdef DEBUG_MODEL
+	/* print results
 	 */
 	/*** TEST TEST TEST TEST *****************************/
 	printf("predict_next: given context_string = \"%s\".\n", format_string16(context_string));
@@ -1104,16 +1642,179 @@ unsigned char predict_next( STRING16 * context_string, STRUCT_PREDICTION * resul
 	printf("\n");
 #endif
 
+	return( results->sym[0].symbol);
+}
 
+/********************************************************************
+** view_context
+**
+** Make a view of the prediction from the context that a query has
+** found: the one at the scratch's current_order.
+**
+** The symbols come out most likely first (update_table() keeps them
+** sorted by count), so the list can stop early: after max_predictions
+** of them, or once the ones listed add up to more than the given
+** probability mass and the last of them has a different count from
+** the one before it (so a run of equally likely symbols isn't cut in
+** two).  That is the test analyze_pred_results() uses for a confidence level,
+** done with the same float arithmetic, so the list always holds every
+** prediction it will look at.  The denominator is the table's total,
+** so it is right however short the list is.  The list never goes past
+** MAX_NUM_PREDICTIONS, the size of the list in a STRUCT_PREDICTION.
+********************************************************************/
+void view_context( MODEL *model, MODEL_SCRATCH *scratch, PREDICTION_VIEW *view,
+                   int max_predictions, float mass )
+{
+	int i;
+	int num_symbols;		// number of symbols in the context
+	FROZEN_MODEL *f = &model->frozen;
+	int n;
+	float mass_so_far = 0.0;	// probability of the predictions listed so far
+	int previous_count = 0;		// count of the last prediction listed
+
+	view->depth = scratch->current_order;
+	n = scratch->contexts[ scratch->current_order ];
+	view->symbols = f->symbols + f->nodes[n].first;
+	view->counts = f->counts + f->nodes[n].first;
+	view->codes = f->codes;
+	// Demoninator has two parts, it's the sum of all the counts + the number of elements in the table
+	// (His context[0] table has an extra entry in it, so don't add the extra '1'
+#ifdef REMOVED_FOR_CONFIDENCE_LEVEL_TESTING
+	if (scratch->current_order == 0)
+		view->prob_denominator = f->nodes[n].max_index;
+	else
+		view->prob_denominator = f->nodes[n].max_index + 1;	// this is the number of elements in the table.
+#else
+	view->prob_denominator = frozen_total( f, n);
+#endif
+	num_symbols = f->nodes[n].max_index + 1;
+	view->num_candidates = (num_symbols < MAX_NUM_PREDICTIONS) ? num_symbols : MAX_NUM_PREDICTIONS;
+
+	if (max_predictions > view->num_candidates)
+		max_predictions = view->num_candidates;
+	if (mass >= 1.0)
+		i = max_predictions;
+	else
+		for (i = 0; i < max_predictions; ) {
+			mass_so_far += (float) VIEW_COUNT( view, i) / (float) view->prob_denominator;
+			if (mass_so_far > mass && VIEW_COUNT( view, i) != previous_count) {
+				i++;
+				break;
+				}
+			previous_count = VIEW_COUNT( view, i);
+			i++;
+			}
+	view->num_predictions = i;
+}
+
+/********************************************************************
+** report_prediction
+**
+** Fill in the results of a prediction from the context that a query
+** has found: the one at the scratch's current_order.  This is the
+** second half of predict_next(), which predict_from_context() shares.
+** The predictions are copied out of a view (see view_context()).
+********************************************************************/
+void report_prediction( MODEL *model, MODEL_SCRATCH *scratch, STRUCT_PREDICTION * results,
+                        int max_predictions, float mass )
+{
+	int i;
+	PREDICTION_VIEW view;
+
+	view_context( model, scratch, &view, max_predictions, mass);
+	results->depth = view.depth;
+	results->prob_denominator = view.prob_denominator;
+	results->num_candidates = view.num_candidates;
+	for (i=0; i < view.num_predictions; i++)	{
+		// store information about this symbol
+		results->sym[i].symbol = VIEW_SYMBOL( &view, i);
+		results->sym[i].prob_numerator = VIEW_COUNT( &view, i);
+		}
+	results->num_predictions = i;
+}
+
+/*************************************************************
+ * load_rolling_context
+ * Make the scratch's rolling context the context at its current_order,
+ * for report_prediction() or view_context().
+ *************************************************************/
+void load_rolling_context( MODEL *model, MODEL_SCRATCH *scratch ) {
+	scratch->current_order = scratch->context_order;
+	scratch->contexts[ scratch->current_order ] = scratch->context_node;
+}
+
+/*************************************************************
+ * predict_from_rolling_context
+ * Fill in the results from the scratch's rolling context, listing
+ * as many predictions as report_prediction() is told to.
+ *************************************************************/
+unsigned char predict_from_rolling_context( MODEL *model, MODEL_SCRATCH *scratch, STRUCT_PREDICTION * results,
+                                            int max_predictions, float mass ) {
+	load_rolling_context( model, scratch);
+	report_prediction( model, scratch, results, max_predictions, mass);
 	return( results->sym[0].symbol);
 }
 
+/*************************************************************
+ * predict_view
+ * Make a view of the prediction from the scratch's rolling context,
+ * listing no more than k predictions, and stopping at the given
+ * probability mass like predict_until_mass().  (Use MAX_NUM_PREDICTIONS
+ * and ALL_OF_THE_MASS for no limits.)  Nothing is copied.
+ *************************************************************/
+void predict_view( MODEL *model, MODEL_SCRATCH *scratch, int k, float mass, PREDICTION_VIEW *view ) {
+	load_rolling_context( model, scratch);
+	view_context( model, scratch, view, k, mass);
+}
+
+/*************************************************************
+ * predict_view_at_order
+ * predict_view(), but as if the model's max_order were the given
+ * order (no more than it).  There's no update exclusion (see
+ * update_model()), so the tables up to that order are the ones a
+ * model trained with that max_order would have, and the context such
+ * a model would have rolled along to is the model's rolling context,
+ * cut down to that order by following its lesser context pointers.
+ * (Any suffix of a context in the model is in it too.)  So one model
+ * and one rolling context can be queried for every order up to its own.
+ *************************************************************/
+void predict_view_at_order( MODEL *model, MODEL_SCRATCH *scratch, int order, int k, float mass, PREDICTION_VIEW *view ) {
+	FROZEN_MODEL *f = &model->frozen;
+
+	load_rolling_context( model, scratch);
+	for ( ; scratch->current_order > order; scratch->current_order--)
+		scratch->contexts[ scratch->current_order-1 ] =
+			f->nodes[ scratch->contexts[ scratch->current_order ] ].lesser;
+	view_context( model, scratch, view, k, mass);
+}
+
 /** print_model_allocation
  *  print out the statistics on memory usage
  */
-void print_model_allocation()
+void print_model_allocation( MODEL *model )
 {
-	printf("%d CONTEXT tables allocated.\n", alloc_count);
+	int i;
+
+	printf("%d CONTEXT tables allocated.\n", model->alloc_count);
+	for (i = -2; i <= model->max_order; i++)
+		printf("  order %d: %ld arena bytes\n", i, model->order_bytes[i]);
+	printf("%lu arena bytes in use, %lu bytes reserved.\n",
+			(unsigned long) model->arena.in_use,
+			(unsigned long) model->arena.reserved);
+	printf("%ld table array reallocations, %ld avoided.\n",
+			model->table_reallocs, model->table_reallocs_avoided);
+	if (model->saturated_rescales != 0)
+		printf("%ld tables rescaled because a count reached %d.\n",
+				model->saturated_rescales, MAX_COUNT);
+	if (model->memory_budget > 0)
+		printf("memory budget %ld bytes: %ld tables pruned in %ld runs.\n",
+				model->memory_budget, model->tables_pruned, model->prune_runs);
+	if (model->frozen.image != NULL)
+		printf("frozen model: %d nodes, %d entries, %lu bytes%s.\n",
+				model->frozen.image->num_nodes,
+				model->frozen.image->num_entries,
+				(unsigned long) model->frozen.image->image_bytes,
+				(model->frozen.mapping != NULL) ? " (mapped from the model file)" : "");
 }
 
 /*************************************************************
@@ -1121,20 +1822,24 @@ void print_model_allocation()
  * Given a context string, traverse the tree.
  * Assumes context_string length < max_order
  * INPUTS: context string (it may be empty, that's oK)
- * OUTPUTS: current_order is set to largest order where context
+ * OUTPUTS: the scratch's current_order is set to largest order where context
  * 		was found
- * 		contexts[] pointers set up (valid from 0 to current_order)
+ * 		its contexts[] pointers set up (valid from -2 to current_order)
  * RETURNS: void
  *
  *************************************************************/
-void traverse_tree( STRING16 * context_string) {
+void traverse_tree( MODEL *model, MODEL_SCRATCH *scratch, STRING16 * context_string) {
 	int i;
-	CONTEXT *table;
+	FROZEN_MODEL *f = &model->frozen;
+	int n;			// node we are currently searching
+	int next;		// node its link leads to
 	SYMBOL_TYPE test_char;	// char we are currently looking for in tree
 	int local_order;
 	int index_into_string;
 	int done = false;
 
+	start_query( model, scratch);
+
 	// Traverse the tree, trying to find the context string.
 	// If the entire context string can't be found,
 	// trim the first char off of the context string and try again.
@@ -1155,18 +1860,13 @@ void traverse_tree( STRING16 * context_string) {
 		done = true;
 
 	while (!done)	{		// traversing tree
-		test_char = get_symbol(context_string, index_into_string );
-		table = contexts[ local_order ];
+		test_char = symbol_id( model, get_symbol(context_string, index_into_string ));
+		n = scratch->contexts[ local_order ];
 		// Search this table for this character
-		i = 0;
-		while (i <= table->max_index &&
-			table->stats[i].symbol != test_char &&
-			table->max_index >= 0)
-			{
-			i++;
-			}
-		if ((i > table->max_index) ||			// didn't find this symbol in the table
-				((table->links[i].next)->max_index == -1)) // there is no further symbols for this context
+		i = frozen_find( f, n, test_char);
+		if ((i < 0) ||			// didn't find this symbol in the table
+				((next = f->child[ f->nodes[n].first + i ]) < 0) ||	// its table was pruned
+				(f->nodes[next].max_index == -1)) // there is no further symbols for this context
 												// (this second case only happens for
 												// the very end of the training
 												// string.  You could have a branch
@@ -1195,27 +1895,133 @@ void traverse_tree( STRING16 * context_string) {
 		if (++index_into_string == strlen16( context_string))
 			done = true;
 		local_order++;
-		contexts[local_order] = table->links[i].next;
+		scratch->contexts[local_order] = next;
 		}
-	table = contexts[ local_order ];
-	current_order = local_order;
+	scratch->current_order = local_order;
 
 	/* At this point, we have traversed the tree and we are
 	 * pointing to the best context that we can find.
-	 * table points to this context table
+	 * contexts[ current_order ] is this context's node
 	 * current_order is the depth (or order) of this model
 	 */
 	return;
 }
+/*************************************************************
+ * reset_context
+ * Start the scratch's rolling context over, at the order 0 table,
+ * as if no symbols had been seen yet.
+ *************************************************************/
+void reset_context( MODEL *model, MODEL_SCRATCH *scratch ) {
+	start_query( model, scratch);
+	scratch->context_node = 2;		// the order 0 node
+	scratch->context_order = 0;
+}
+
+/*************************************************************
+ * advance_context
+ * Move the rolling context along by one symbol.  The rolling context
+ * is always the longest of the last max_order symbols (or fewer) that
+ * traverse_tree() would find, so it can be found from the last one:
+ * if "abc" is the rolling context and 'd' comes along, "abcd" is too
+ * long, so try "bcd", then "cd", then "d", by following the lesser
+ * context pointers down from "abc" and looking for 'd' in each table.
+ * Each symbol moves the context up at most one order, so this costs
+ * no more than one table lookup per symbol on average, where
+ * traverse_tree() walks down from the order 0 table every time.
+ * (Any string with a table in the model also has a table for each
+ * of its suffixes, which is what makes this work.)
+ * INPUTS: c = the next symbol of the string (a code, not an id)
+ *************************************************************/
+void advance_context( MODEL *model, MODEL_SCRATCH *scratch, SYMBOL_TYPE c ) {
+	int i;
+	FROZEN_MODEL *f = &model->frozen;
+	int n;
+	int next;
+
+	if (model->max_order == 0)		// the context is always empty
+		return;
+	c = symbol_id( model, c);
+	n = scratch->context_node;
+	if (scratch->context_order == model->max_order) {
+		n = f->nodes[n].lesser;		// make room for c
+		scratch->context_order--;
+	}
+	for ( ; ; ) {
+		i = frozen_find( f, n, c);
+		if (i >= 0) {
+			next = f->child[ f->nodes[n].first + i ];
+			if (next >= 0 && f->nodes[next].max_index != -1) {	// same test as traverse_tree()
+				scratch->context_node = next;
+				scratch->context_order++;
+				return;
+			}
+		}
+		if (scratch->context_order == 0)
+			break;				// c isn't even in the order 0 table
+		n = f->nodes[n].lesser;
+		scratch->context_order--;
+	}
+	scratch->context_node = n;
+}
+
+/*************************************************************
+ * predict_from_context
+ * predict_next() for the scratch's rolling context: fill in the
+ * results with the symbols that could follow it.
+ *************************************************************/
+unsigned char predict_from_context( MODEL *model, MODEL_SCRATCH *scratch, STRUCT_PREDICTION * results) {
+	return( predict_from_rolling_context( model, scratch, results, MAX_NUM_PREDICTIONS, ALL_OF_THE_MASS));
+}
+
+/*************************************************************
+ * predict_top_k
+ * predict_from_context(), but only the k most likely symbols are
+ * listed.  (The denominator still covers all of them.)
+ *************************************************************/
+unsigned char predict_top_k( MODEL *model, MODEL_SCRATCH *scratch, int k, STRUCT_PREDICTION * results) {
+	return( predict_from_rolling_context( model, scratch, results, k, ALL_OF_THE_MASS));
+}
+
+/*************************************************************
+ * predict_until_mass
+ * predict_from_context(), but the list stops once the symbols listed
+ * add up to more than the given probability (0 to 1), without cutting
+ * a run of equally likely symbols in two.  See report_prediction().
+ *************************************************************/
+unsigned char predict_until_mass( MODEL *model, MODEL_SCRATCH *scratch, float mass, STRUCT_PREDICTION * results) {
+	return( predict_from_rolling_context( model, scratch, results, MAX_NUM_PREDICTIONS, mass));
+}
+
+/*************************************************************
+ * load_context_chain
+ * Set up the scratch's contexts[] from the
+ * rolling context down to order 1, by following the lesser context
+ * links, so that the rolling context and all of its suffixes are
+ * ready for a query, just as traverse_tree() would leave them.
+ *************************************************************/
+void load_context_chain( MODEL *model, MODEL_SCRATCH *scratch ) {
+	int i;
+	FROZEN_MODEL *f = &model->frozen;
+
+	i = scratch->context_order;
+	scratch->contexts[ i ] = scratch->context_node;
+	for ( ; i > 1; i--)
+		scratch->contexts[ i-1 ] = f->nodes[ scratch->contexts[ i ] ].lesser;
+}
+
 /****************************************************8
  * clear_scoreboard
- * Clear the scoreboard
+ * Clear the scoreboard, by starting a new epoch: the symbols that were
+ * excluded are stamped with the old one.  Only when the epoch counter
+ * wraps around does the scoreboard have to be wiped for real.
  ******************************************************/
-void clear_scoreboard() {
-	int i;
-
-    for ( i = 0 ; i < RANGE_OF_SYMBOLS ; i++ )
-        scoreboard[ i ] = 0;
+void clear_scoreboard( MODEL *model, MODEL_SCRATCH *scratch ) {
+	fit_scoreboard( model, scratch);
+	if (++scratch->epoch == 0) {
+		memset( scratch->scoreboard, 0, scratch->scoreboard_size * sizeof( unsigned int ));
+		scratch->epoch = 1;
+	}
+	scratch->num_excluded = 0;
 }
 
 
@@ -1225,92 +2031,748 @@ void clear_scoreboard() {
  * Given a test string, calculate the average
  * log-loss for encoding the string.
  *
+ * This gives exactly the same numbers as it did when it looked up the
+ * context string of each symbol with traverse_tree() and, each time the
+ * symbol had to be escaped, shortened the string by one and looked it
+ * up again from the order 0 table, until the string was down to one
+ * symbol.  (traverse_tree() leaves the string as long as the context it
+ * finds, so each escape went down exactly one order.)  Now the rolling
+ * context (see advance_context()) is the context that traverse_tree()
+ * would find, and the contexts an escape goes down through are its
+ * lesser contexts, which are loaded once per symbol.
+ *
+ * The test file is mapped if it can be (see map_string16()), and tested
+ * in one piece.  Otherwise it's read TEST_CHUNK_LENGTH symbols at a time,
+ * and the rolling context just carries on from one piece to the next, so
+ * a test file can be any length.  The last max_order symbols of each
+ * piece are kept in front of the next one for the verbose output.
+ *
  * INPUTS:
- * 	  test_string = pointer to string to test.
+ * 	  test_file = the file to test (opened for reading).
  *
- * RETURNS: nothing
+ * RETURNS: the average log-loss
+ * *********************************************/
+float compute_logloss( MODEL *model, MODEL_SCRATCH *scratch, FILE *test_file, int verbose){
+	int order = model->max_order;
+	float logloss;
+
+	compute_logloss_orders( model, scratch, test_file, verbose, 1, &order, &logloss);
+	return (logloss);
+}	// end of compute_logloss
+
+/*******************************************
+ * compute_logloss_orders
+ *
+ * compute_logloss() for each of the given orders (none of them more
+ * than the model's max_order) at once, in one pass over the test file:
+ * the log-loss for an order is the one a model trained with that
+ * max_order would give (see predict_view_at_order()).  Each symbol's
+ * contexts are loaded once, and each order starts its escapes from the
+ * rolling context cut down to that order.  The verbose output has a
+ * line for each order for each symbol.
+ *
+ * INPUTS:
+ * 	  test_file = the file to test (opened for reading).
+ * 	  orders = the num_orders orders to test.
+ * OUTPUTS: logloss[k] = the average log-loss for orders[k]
  * *********************************************/
-float compute_logloss( STRING16 * test_string, int verbose){
-	int i;			// index into test string
+void compute_logloss_orders( MODEL *model, MODEL_SCRATCH *scratch, FILE *test_file, int verbose,
+                             int num_orders, const int *orders, float *logloss){
+	int i;			// index into test file
+	int j;			// index into the piece of it in test_string
+	int k;			// index into orders
+	int num_read;	// number of new symbols in test_string
 	int length=0;		// string length
+	int context_length;	// length of the context string
+	int order;		// order of the context in use
     SYMBOL s;		// interval information
     int escaped;	// true if we hit ESCAPE situation.
     double prob_numerator, prob_denominator;	// for calculating probabilities for each char
     float fl_prob;	// probability as a float
-    float summation = 0.0;	// summation of the log-base-2(P())
-    STRING16 * str_sub;
+    STRING16 * test_string;	// the piece of the test file being tested
+    STRING16 * str_sub;		// the context string, for the verbose output
 
     if (verbose)	{
  //   	printf("compute_logloss: Testing on string \"%s\"\n", format_string_16(test_string));
     	}
 
-    // Create working substring
-    str_sub = string16(max_order);
+    for (k=0; k < num_orders; k++)
+    	logloss[k] = 0.0;	// summation of the log-base-2(P()), to start with
+    test_string = map_string16( test_file);
+    if (test_string != NULL)
+    	num_read = strlen16( test_string);
+    else	{
+    	test_string = string16(TEST_CHUNK_LENGTH+1);
+    	num_read = fread16_more( test_string, model->max_order, test_file);
+    }
+    str_sub = string16(model->max_order);
+    reset_context( model, scratch);
 
 	// Calculate the probability of each character in the test string.
 	// Since this calculation has to do with encoding, we need to include
 	// the ESCAPE probabilities and the EXCLUSION mechanism, which
 	// are handled by the convert_int_to_symbol routine.
 
-	for (i=0; i < strlen16( test_string) ; i++)	{
-
-		// Create the context string, which is the max_order characters
-		// before the character in question.
-		// Ex.  If the test_string is "abcdef" and i is 5, the
-		// test character will be 'f' and the context string (for
-		// a model order of 2) is the 2 characters before the 'f', which
-		// are "de".
-
-		if (i < max_order)  {
-			strncpy16( str_sub, test_string, 0, i);	// create test string
-			}
-		else {
-			strncpy16( str_sub, test_string, i-max_order, max_order);
-			}
-		prob_numerator = 1;
-		prob_denominator = 1;
-		clear_scoreboard();
-		if (verbose)
-			printf("\t%d: log2(P(0x%04x|\"%s\")",
-					i, get_symbol(test_string, i), format_string16(str_sub));	// print first part of line
-
-		do {
-			//printf("\ttraverse for \"%s\"\n", format_string16(str_sub));
-			traverse_tree( str_sub);		// set pointers to best context
-			escaped = convert_int_to_symbol( get_symbol(test_string,i), &s);
-			//printf("\thigh=%d, low=%d, scale=%d\n", s.high_count, s.low_count, s.scale);
-			if (s.scale != 0) {
-				prob_numerator *= (s.high_count - s.low_count);
-				prob_denominator *= s.scale;
-				//printf("\tnum=%f,denom=%f\n", prob_numerator, prob_denominator);
-				}
-			if (escaped){
-				/* If the test char isn't found in this table, shorten the context and try again. */
-				//printf("escaped..");
-				// was ==>  if (strlen16(str_sub)== 0) {   	// can't shorten anymore
-				if (strlen16(str_sub)<= 1) {   	// can't shorten anymore
-					//printf(" abort\n");
-					escaped=false;				// abort if not found
+	i = 0;
+	for ( ; num_read > 0; num_read = fread16_more( test_string, model->max_order, test_file))	{
+		for (j=strlen16( test_string) - num_read; j < strlen16( test_string) ; i++, j++)	{
+			load_context_chain( model, scratch);
+			for (k=0; k < num_orders; k++)	{
+
+				// The context string is the orders[k] characters
+				// before the character in question.
+				// Ex.  If the test_string is "abcdef" and i is 5, the
+				// test character will be 'f' and the context string (for
+				// a model order of 2) is the 2 characters before the 'f', which
+				// are "de".
+				context_length = (i < orders[k]) ? i : orders[k];
+				prob_numerator = 1;
+				prob_denominator = 1;
+				clear_scoreboard( model, scratch);
+				if (verbose) {
+					strncpy16( str_sub, test_string, j-context_length, context_length);
+					printf("\t%d: log2(P(0x%04x|\"%s\")",
+							i, get_symbol(test_string, j), format_string16(str_sub));	// print first part of line
 					}
+
+				// Start with the order traverse_tree() would find for the context string
+				if (context_length == 0)
+					order = 0;
+				else if (scratch->context_order == 0)
+					order = -1;			// not even the last symbol was found
 				else
-					shorten_string16( str_sub);	// remove first char from context
-				}
-		} while (escaped);
+					order = (scratch->context_order < orders[k]) ? scratch->context_order : orders[k];
+
+				do {
+					scratch->current_order = order;
+					escaped = convert_int_to_symbol( model, scratch, get_symbol(test_string,j), &s);
+					if (s.scale != 0) {
+						prob_numerator *= (s.high_count - s.low_count);
+						prob_denominator *= s.scale;
+						}
+					if (escaped){
+						/* If the test char isn't found in this table, go down to the lesser context. */
+						if (order <= 1)   	// can't shorten anymore
+							escaped=false;				// abort if not found
+						else
+							order--;
+						}
+				} while (escaped);
+
+				fl_prob = (float) prob_numerator/(float) prob_denominator;
+				//printf("fl_prob (%c)= %f\n", test_string[i], fl_prob);
+				logloss[k] += log10(fl_prob);
+				if (verbose)
+					printf("= %f\n", log10(fl_prob)/log10(2.0));
+			}
+			advance_context( model, scratch, get_symbol(test_string,j));
+		}
+	}
 
-		fl_prob = (float) prob_numerator/(float) prob_denominator;
-		//printf("fl_prob (%c)= %f\n", test_string[i], fl_prob);
-		summation += log10(fl_prob);
+	length = i;		// the number of symbols tested
+	for (k=0; k < num_orders; k++)	{
+		// Convert logbase10 to log base 2 by diving by log-base-10(2)
+		logloss[k] /= log10(2.0);
+		// Take the average and change the sign
+		logloss[k] /= length;
+		logloss[k] *= -1.0;
 		if (verbose)
-			printf("= %f\n", log10(fl_prob)/log10(2.0));
+			printf("average log-loss is %f\n", logloss[k]);
 	}
+	delete_string16( str_sub);
+	delete_string16( test_string);
+}	// end of compute_logloss_orders
+
 
-	// Convert logbase10 to log base 2 by diving by log-base-10(2)
-	summation /= log10(2.0);
-	// Take the average and change the sign
-	summation /= length;
-	summation *= -1.0;
-	if (verbose)
-		printf("average log-loss is %f\n", summation);
-	return (summation);
-}	// end of compute_logloss
 
+/*************************************************************
+ * The rest of this file freezes the model.  See FROZEN_MODEL in
+ * model.h for the layout of the frozen copy.  The query routines
+ * above all work on the frozen copy; the routines down here build
+ * it, save and load it, and look things up in its nodes.
+ *************************************************************/
+
+// Round a size up to the 8-byte boundary every array in the block starts on.
+#define FROZEN_ALIGN( n )	( ( (n) + 7 ) & ~(size_t) 7 )
+
+/*
+ * count_frozen_tables adds up the nodes, entries and hash cells that
+ * the given table and all of the tables below it will need in the
+ * frozen model.
+ */
+void count_frozen_tables( CONTEXT *table, FROZEN_HEADER *header )
+{
+    int i;
+
+    header->num_nodes++;
+    header->num_entries += table->max_index + 1;
+    header->num_hash_cells += table->hash_size;
+    if ( table->links != NULL )
+        for ( i = 0 ; i <= table->max_index ; i++ )
+            if ( table->links[ i ].next != NULL )
+                count_frozen_tables( table->links[ i ].next, header );
+}
+
+/*
+ * point_into_frozen_image sets the array pointers of f to their places
+ * in the block that starts with the given header, and returns the size
+ * of the block.  (The header is at the start of the block.)
+ */
+size_t point_into_frozen_image( FROZEN_MODEL *f, FROZEN_HEADER *header )
+{
+    char *image;
+    size_t offset;
+
+    image = (char *) header;
+    f->image = header;
+    offset = FROZEN_ALIGN( sizeof( FROZEN_HEADER ) );
+    f->nodes = (FROZEN_NODE *) ( image + offset );
+    offset += FROZEN_ALIGN( header->num_nodes * sizeof( FROZEN_NODE ) );
+    f->symbols = (SYMBOL_TYPE *) ( image + offset );
+    offset += FROZEN_ALIGN( header->num_entries * sizeof( SYMBOL_TYPE ) );
+    f->counts = (COUNT_TYPE *) ( image + offset );
+    offset += FROZEN_ALIGN( header->num_entries * sizeof( COUNT_TYPE ) );
+    f->cumulative = (int *) ( image + offset );
+    offset += FROZEN_ALIGN( header->num_entries * sizeof( int ) );
+    f->child = (int *) ( image + offset );
+    offset += FROZEN_ALIGN( header->num_entries * sizeof( int ) );
+    f->hash_cells = (int *) ( image + offset );
+    offset += FROZEN_ALIGN( header->num_hash_cells * sizeof( int ) );
+    f->codes = (SYMBOL_TYPE *) ( image + offset );
+    offset += FROZEN_ALIGN( header->num_codes * sizeof( SYMBOL_TYPE ) );
+    return( offset );
+}
+
+/*
+ * scale_frozen_node works out how node n would be rescaled if its table
+ * were totalized the old way, with rescale_table() called whenever the
+ * totals got too big: its counts are halved (and a leaf node drops its
+ * trailing zero counts) until the escape total is less than
+ * MAXIMUM_SCALE.  The block keeps the counts as they are, for the
+ * predictions, and the node keeps the number of halvings and the
+ * trimmed max_index, for coding (see FROZEN_COUNT).  The totals are
+ * added up with nothing excluded, which is as big as they get for any
+ * query, so no query ever has to rescale a node.
+ */
+void scale_frozen_node( FROZEN_MODEL *f, int n, int is_leaf )
+{
+    FROZEN_NODE *node = &f->nodes[ n ];
+    short int total;		// totals[ 0 ] in totalize_table()
+    unsigned char max;
+    int i;
+
+    node->scale_shift = 0;
+    node->scaled_max_index = node->max_index;
+    for ( ; ; )
+    {
+        total = 0;
+        max = 0;
+        for ( i = 0 ; i <= node->scaled_max_index ; i++ )
+        {
+            total += FROZEN_COUNT( f, n, i );
+            if ( FROZEN_COUNT( f, n, i ) > max )
+                max = FROZEN_COUNT( f, n, i );
+        }
+        if ( max == 0 )
+            return;			// the escape total is 1
+        if ( node->order == 0 )
+            total += node->scaled_max_index;
+        else
+            total += node->scaled_max_index + 1;
+        if ( total < MAXIMUM_SCALE )
+            return;
+        node->scale_shift++;
+        if ( is_leaf )
+            while ( node->scaled_max_index >= 0 &&
+                    FROZEN_COUNT( f, n, node->scaled_max_index ) == 0 )
+                node->scaled_max_index--;
+    }
+}
+
+/*
+ * freeze_model compiles the context tables into a frozen model (one
+ * block of memory), which the query routines will use until the model
+ * is changed again.  The tables are numbered breadth-first with a queue
+ * of table pointers; a table's number is given out when it is put on
+ * the queue, so that its parent's child[] entries can be filled in
+ * right away.  Its lesser node is filled in then, too: the lesser
+ * context of "ABC" is the 'C' child of the lesser context of "AB",
+ * which has a lower order, so it has already been numbered.
+ */
+void freeze_model( MODEL *model )
+{
+    FROZEN_HEADER counts;		// sizes of the arrays
+    FROZEN_MODEL f;
+    FROZEN_NODE *node;
+    CONTEXT **queue;
+    CONTEXT *table;
+    size_t image_bytes;
+    int head, tail;
+    int first, cells;
+    int i, j;
+
+    thaw_model( model );
+
+/*
+ * Count everything first, so the block can be allocated in one piece.
+ */
+    memset( &counts, 0, sizeof( counts ) );
+    counts.num_nodes = 2;		// the control and null tables
+    counts.num_entries = model->contexts[ -2 ]->max_index + 1 +
+                         model->contexts[ -1 ]->max_index + 1;
+    count_frozen_tables( model->contexts[ 0 ], &counts );
+    counts.max_order = model->max_order;
+    counts.num_codes = model->alphabet.size;
+
+    image_bytes = point_into_frozen_image( &f, &counts );
+    f.image = (FROZEN_HEADER *) calloc( image_bytes, 1 );
+    queue = (CONTEXT **) malloc( counts.num_nodes * sizeof( CONTEXT * ) );
+    if ( f.image == NULL || queue == NULL )
+        error_exit( "Error #16: allocating frozen model!" );
+    counts.image_bytes = image_bytes;
+    *f.image = counts;
+    point_into_frozen_image( &f, f.image );
+
+    queue[ 0 ] = model->contexts[ -2 ];
+    queue[ 1 ] = model->contexts[ -1 ];
+    queue[ 2 ] = model->contexts[ 0 ];
+    f.nodes[ 0 ].lesser = -1;
+    f.nodes[ 1 ].lesser = 0;
+    f.nodes[ 2 ].lesser = 1;
+    tail = 3;
+    first = 0;
+    cells = 0;
+    for ( head = 0 ; head < tail ; head++ )
+    {
+        table = queue[ head ];
+        node = &f.nodes[ head ];
+        node->first = first;
+        node->max_index = table->max_index;
+        node->order = table->order;
+        node->hash_first = cells;
+        node->hash_size = table->hash_size;
+        for ( i = 0 ; i <= table->max_index ; i++ )
+        {
+            f.symbols[ first+i ] = table->symbols[ i ];
+            f.counts[ first+i ] = table->counts[ i ];
+            f.child[ first+i ] = -1;
+        }
+        for ( i = table->max_index ; i >= 0 ; i-- )
+            f.cumulative[ first+i ] = table->counts[ i ] +
+                ( ( i < table->max_index ) ? f.cumulative[ first+i+1 ] : 0 );
+        scale_frozen_node( &f, head, table->links == NULL );
+        if ( table->order == -1 )
+            f.child[ first ] = 2;		// the null table's only link is to the order 0 table
+        else if ( table->links != NULL )
+            for ( i = 0 ; i <= table->max_index ; i++ )
+                if ( table->links[ i ].next != NULL )
+                {
+                    f.child[ first+i ] = tail;
+                    if ( table->order == 0 )
+                        f.nodes[ tail ].lesser = 2;
+                    else
+                    {
+                        j = find_symbol_in_table( table->lesser_context, table->symbols[ i ] );
+                        f.nodes[ tail ].lesser = f.child[ f.nodes[ node->lesser ].first + j ];
+                    }
+                    queue[ tail++ ] = table->links[ i ].next;
+                }
+        for ( i = 0 ; i < table->hash_size ; i++ )
+            f.hash_cells[ cells+i ] = table->hash[ i ];
+        first += table->max_index + 1;
+        cells += table->hash_size;
+    }
+    for ( i = 0 ; i < model->alphabet.size ; i++ )
+        f.codes[ i ] = alphabet_code( &model->alphabet, i );
+    free( queue );
+
+    install_frozen_model( model, f.image );
+}
+
+/*
+ * install_frozen_model makes the given block (which has been built or
+ * read in) the frozen model that queries will use.  Nothing here walks
+ * the nodes, so installing a mapped block doesn't touch its pages.
+ */
+void install_frozen_model( MODEL *model, FROZEN_HEADER *image )
+{
+    point_into_frozen_image( &model->frozen, image );
+}
+
+/*
+ * check_frozen_header returns true if a block header that came from a
+ * file looks sane: the sizes are possible, and add up to the size of
+ * the block.  The rest of the block is checked by check_frozen_nodes(),
+ * once it has been read in.
+ */
+int check_frozen_header( FROZEN_HEADER *header )
+{
+    FROZEN_MODEL f;
+
+    if ( header->max_order < 0 || header->max_order > 7 ||	// contexts[] holds orders -2..7
+         header->num_nodes < 3 ||
+         header->num_entries < 0 ||
+         header->num_hash_cells < 0 ||
+         header->num_codes < 1 || header->num_codes > ALPHABET_UNKNOWN )
+        return( false );
+    return( point_into_frozen_image( &f, header ) == header->image_bytes );
+}
+
+/*
+ * check_frozen_nodes returns true if the rest of a block that came from
+ * a file (one whose header passed check_frozen_header()) can be queried
+ * without going outside of the block.  Every node's entries and hash
+ * cells have to lie inside the arrays, and every hash cell has to hold
+ * -1 or one of the node's entries.  Every hash has to have an empty
+ * cell, so a probe always stops.  The lesser and child links have to
+ * go down and up one order, so walking them stays within the orders
+ * that a scratch has room for.  The symbols of orders 0 and up have to
+ * be ids in the alphabet, and the alphabet can't have a code twice.
+ * The cumulative counts are checked against the counts as well, since
+ * frozen_interval() takes them on trust.  This has to look at the whole
+ * block, so it touches every page of a mapped file once.
+ */
+int check_frozen_nodes( FROZEN_HEADER *header )
+{
+    FROZEN_MODEL f;
+    FROZEN_NODE *node;
+    ALPHABET codes;
+    int n;
+    int i;
+    int entry;
+    int child;
+    int empty_cells;
+    int ok;
+
+    point_into_frozen_image( &f, header );
+    for ( n = 0 ; n < header->num_nodes ; n++ )
+    {
+        node = &f.nodes[ n ];
+        if ( n <= 2 ? node->order != n - 2 :
+                      node->order < 1 || node->order > header->max_order )
+            return( false );
+        if ( n == 0 ? node->lesser != -1 :
+                      node->lesser < 0 || node->lesser >= n ||
+                      f.nodes[ node->lesser ].order != node->order - 1 )
+            return( false );
+        if ( node->max_index < -1 || node->first < 0 ||
+             node->first > header->num_entries - ( node->max_index + 1 ) )
+            return( false );
+        if ( node->scale_shift < 0 || node->scale_shift > 16 ||
+             node->scaled_max_index < -1 || node->scaled_max_index > node->max_index )
+            return( false );
+        for ( i = 0 ; i <= node->max_index ; i++ )
+        {
+            entry = node->first + i;
+            if ( node->order >= 0 &&
+                 ( f.symbols[ entry ] < 0 || f.symbols[ entry ] >= header->num_codes ) )
+                return( false );
+            child = f.child[ entry ];
+            if ( child != -1 &&
+                 ( child <= n || child >= header->num_nodes ||
+                   f.nodes[ child ].order != node->order + 1 ) )
+                return( false );
+            if ( f.cumulative[ entry ] != f.counts[ entry ] +
+                 ( ( i < node->max_index ) ? f.cumulative[ entry+1 ] : 0 ) )
+                return( false );
+        }
+        if ( node->hash_size == 0 )
+            continue;
+        if ( node->hash_size < 0 || ( node->hash_size & ( node->hash_size - 1 ) ) != 0 ||
+             node->hash_first < 0 ||
+             node->hash_first > header->num_hash_cells - node->hash_size )
+            return( false );
+        empty_cells = 0;
+        for ( i = 0 ; i < node->hash_size ; i++ )
+        {
+            entry = f.hash_cells[ node->hash_first + i ];
+            if ( entry == -1 )
+                empty_cells++;
+            else if ( entry < 0 || entry > node->max_index )
+                return( false );
+        }
+        if ( empty_cells == 0 )
+            return( false );
+    }
+
+    ok = true;
+    alphabet_init( &codes );
+    for ( i = 0 ; i < header->num_codes && ok ; i++ )
+        ok = ( alphabet_add( &codes, f.codes[ i ] ) == i );
+    alphabet_destroy( &codes );
+    return( ok );
+}
+
+/*
+ * save_model writes the model (freezing it first if need be) to the
+ * named file.  It returns false if the file couldn't be written.
+ */
+int save_model( MODEL *model, char *file_name, int research_question )
+{
+    FILE *model_file;
+    MODEL_FILE_HEADER header;
+    int ok;
+
+    if ( model->frozen.image == NULL )
+        freeze_model( model );
+    model_file = fopen( file_name, "wb" );
+    if ( model_file == NULL )
+        return( false );
+    header.magic = MODEL_FILE_MAGIC;
+    header.version = MODEL_FILE_VERSION;
+    header.symbol_bytes = sizeof( SYMBOL_TYPE );
+    header.research_question = research_question;
+    ok = fwrite( &header, sizeof( header ), 1, model_file ) == 1 &&
+         fwrite( model->frozen.image, model->frozen.image->image_bytes, 1, model_file ) == 1;
+    if ( fclose( model_file ) != 0 )
+        ok = false;
+    return( ok );
+}
+
+/*
+ * map_model_file maps a whole model file read-only, and returns a
+ * pointer to the block inside the mapping (just past the
+ * MODEL_FILE_HEADER).  The start and length of the mapping are returned
+ * through the last two arguments, for munmap().  It returns NULL if the
+ * file can't be mapped, or is too short to hold the block.
+ */
+FROZEN_HEADER *map_model_file( FILE *model_file, size_t image_bytes,
+                               void **mapping, size_t *mapping_bytes )
+{
+#ifndef NO_MMAP
+    struct stat file_status;
+    void *map_start;
+
+    if ( fstat( fileno( model_file ), &file_status ) != 0 ||
+         (size_t) file_status.st_size < sizeof( MODEL_FILE_HEADER ) + image_bytes )
+        return( NULL );
+    *mapping_bytes = sizeof( MODEL_FILE_HEADER ) + image_bytes;
+    map_start = mmap( NULL, *mapping_bytes, PROT_READ, MAP_SHARED, fileno( model_file ), 0 );
+    if ( map_start == MAP_FAILED )
+        return( NULL );
+    *mapping = map_start;
+    return( (FROZEN_HEADER *) ( (char *) map_start + sizeof( MODEL_FILE_HEADER ) ) );
+#else
+    return( NULL );
+#endif
+}
+
+/*
+ * load_model reads a model written by save_model().  The file is mapped
+ * if it can be (see map_model_file()); otherwise the block is read in
+ * with one fread().  Either way the block is used as it is; nothing is
+ * rebuilt except the alphabet's code -> id table.  The model's
+ * max_order is set to the saved model's order, and the research
+ * question the model was built for is returned through the last
+ * argument.  It returns false (and leaves the model alone) if the file
+ * can't be read or isn't a model file, or if the block doesn't pass
+ * check_frozen_header() and check_frozen_nodes(), so a damaged file
+ * can't send a query outside of the block.
+ *
+ * A loaded model only exists in its frozen form, so it can be queried
+ * but not trained any further: changing the model thaws it, which
+ * leaves the (empty) tables set up by initialize_model().
+ */
+int load_model( MODEL *model, char *file_name, int *research_question )
+{
+    FILE *model_file;
+    MODEL_FILE_HEADER header;
+    FROZEN_HEADER frozen_header;
+    FROZEN_HEADER *image;
+    void *map_start;
+    size_t map_bytes;
+    int i;
+
+    model_file = fopen( file_name, "rb" );
+    if ( model_file == NULL )
+        return( false );
+    if ( fread( &header, sizeof( header ), 1, model_file ) != 1 ||
+         header.magic != MODEL_FILE_MAGIC ||
+         header.version != MODEL_FILE_VERSION ||
+         header.symbol_bytes != sizeof( SYMBOL_TYPE ) ||
+         fread( &frozen_header, sizeof( frozen_header ), 1, model_file ) != 1 ||
+         !check_frozen_header( &frozen_header ) )
+    {
+        fclose( model_file );
+        return( false );
+    }
+    map_start = NULL;
+    map_bytes = 0;
+    image = map_model_file( model_file, frozen_header.image_bytes, &map_start, &map_bytes );
+    if ( image == NULL )
+    {
+        image = (FROZEN_HEADER *) malloc( frozen_header.image_bytes );
+        if ( image == NULL )
+            error_exit( "Error #16: allocating frozen model!" );
+        *image = frozen_header;
+        if ( fread( (char *) image + sizeof( FROZEN_HEADER ),
+                    frozen_header.image_bytes - sizeof( FROZEN_HEADER ), 1, model_file ) != 1 )
+        {
+            free( image );
+            fclose( model_file );
+            return( false );
+        }
+    }
+    fclose( model_file );		// (a mapping stays valid after the file is closed)
+    if ( !check_frozen_nodes( image ) )
+    {
+#ifndef NO_MMAP
+        if ( map_start != NULL )
+            munmap( map_start, map_bytes );
+        else
+#endif
+            free( image );
+        return( false );
+    }
+
+    thaw_model( model );
+    install_frozen_model( model, image );
+    model->frozen.mapping = map_start;
+    model->frozen.mapping_bytes = map_bytes;
+    model->max_order = image->max_order;
+    alphabet_clear( &model->alphabet );
+    for ( i = 0 ; i < image->num_codes ; i++ )
+        add_symbol_to_alphabet( model, model->frozen.codes[ i ] );
+    *research_question = header.research_question;
+    return( true );
+}
+
+/*
+ * take_frozen_model moves the frozen copy of the source model over to
+ * dest, which becomes a frozen-only model like one read by load_model()
+ * (its own alphabet is rebuilt from the frozen codes).  Nothing is
+ * copied, and the source isn't frozen any more, so it can go on being
+ * trained while dest is queried.  dest must have been set up with
+ * initialize_model().
+ */
+void take_frozen_model( MODEL *dest, MODEL *src )
+{
+    int i;
+
+    thaw_model( dest );
+    dest->frozen = src->frozen;
+    memset( &src->frozen, 0, sizeof( FROZEN_MODEL ) );
+    dest->max_order = dest->frozen.image->max_order;
+    alphabet_clear( &dest->alphabet );
+    for ( i = 0 ; i < dest->frozen.image->num_codes ; i++ )
+        add_symbol_to_alphabet( dest, dest->frozen.codes[ i ] );
+}
+
+/*
+ * thaw_model throws the frozen model away (if there is one).  The next
+ * query freezes the tables again.
+ */
+void thaw_model( MODEL *model )
+{
+    FROZEN_MODEL *f = &model->frozen;
+
+    if ( f->image == NULL )
+        return;
+#ifndef NO_MMAP
+    if ( f->mapping != NULL )
+        munmap( f->mapping, f->mapping_bytes );
+    else
+#endif
+        free( f->image );
+    memset( f, 0, sizeof( FROZEN_MODEL ) );
+}
+
+/*
+ * frozen_find returns the entry number of a symbol in node n (like
+ * find_symbol_in_table), or -1 if the symbol isn't there.
+ */
+int frozen_find( FROZEN_MODEL *f, int n, SYMBOL_TYPE symbol )
+{
+    FROZEN_NODE *node;
+
+    node = &f->nodes[ n ];
+    if ( node->hash_size == 0 )
+        return( find_symbol16( f->symbols + node->first, node->max_index + 1, symbol ) );
+    return( f->hash_cells[ node->hash_first +
+                           probe_hash( f->hash_cells + node->hash_first, node->hash_size,
+                                       f->symbols + node->first, symbol ) ] );
+}
+
+/*
+ * frozen_interval works out the same interval for c (an id) in node n
+ * as totalize_table() and convert_int_to_symbol() do, without adding up
+ * the node's totals: they come from the node's cumulative counts, less
+ * the counts of the excluded symbols that are in the node.  There are
+ * usually far fewer of those than there are symbols in a low order
+ * node, so this costs a lookup per excluded symbol instead of a pass
+ * over the node.  It returns 1 if c was escaped, and 0 if not.  The
+ * node's symbols are only put on the scoreboard when c is escaped,
+ * since that's the only time a lower order will need them.  The
+ * cumulative counts are the node's own, so this is only used for a node
+ * that doesn't need rescaling (see scale_frozen_node()).
+ *
+ * totalize_table() keeps its largest count in an unsigned char, so a
+ * node whose largest count is a multiple of 256 gets an escape count of
+ * 1 there.  The counts are sorted, so that comes down to the first one.
+ */
+int frozen_interval( MODEL *model, MODEL_SCRATCH *scratch, int n, SYMBOL_TYPE c, SYMBOL *s )
+{
+    FROZEN_MODEL *f = &model->frozen;
+    int first = f->nodes[ n ].first;
+    int max_index = f->nodes[ n ].max_index;
+    int i, j, k;
+    int excluded_total = 0;		// counts of the excluded symbols in the node ...
+    int excluded_after = 0;		// ... and of the ones after c
+    short int total;		// totals[ 1 ] in totalize_table()
+    short int scale;		// totals[ 0 ]
+    short int low;
+
+    i = frozen_find( f, n, c );
+    if ( i >= 0 && f->counts[ first+i ] == 0 )
+        i = -1;
+    if ( scratch->current_order >= 0 )
+        for ( k = 0 ; k < scratch->num_excluded ; k++ )
+        {
+            j = frozen_find( f, n, scratch->excluded[ k ] );
+            if ( j >= 0 )
+            {
+                excluded_total += f->counts[ first+j ];
+                if ( j > i )
+                    excluded_after += f->counts[ first+j ];
+            }
+        }
+    total = ( max_index >= 0 ) ? f->cumulative[ first ] - excluded_total : 0;
+    if ( max_index < 0 || ( f->counts[ first ] & 0xFF ) == 0 )
+        scale = 1;
+    else if ( scratch->current_order == 0 )
+        scale = total + max_index;
+    else
+        scale = total + max_index + 1;
+
+    s->scale = scale;
+    if ( i >= 0 )
+    {
+        low = ( ( i < max_index ) ? f->cumulative[ first+i+1 ] : 0 ) - excluded_after;
+        s->low_count = low;
+        if ( scratch->current_order >= 0 && EXCLUDED( scratch, c ) )
+            s->high_count = low;
+        else
+            s->high_count = (short int) ( low + f->counts[ first+i ] );
+        return( 0 );
+    }
+
+    s->low_count = total;
+    s->high_count = scale;
+    if ( scratch->current_order >= 0 )
+        for ( j = 0 ; j < max_index ; j++ )
+            if ( f->counts[ first+j ] != 0 )
+                exclude_symbol( scratch, f->symbols[ first+j ] );
+    scratch->current_order--;
+    return( 1 );
+}
+
+/*
+ * frozen_total returns the sum of node n's counts: the first of its
+ * cumulative counts.
+ */
+int frozen_total( FROZEN_MODEL *f, int n )
+{
+    if ( f->nodes[ n ].max_index < 0 )
+        return( 0 );
+    return( f->cumulative[ f->nodes[ n ].first ] );
+}
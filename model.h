@@ -11,11 +11,12 @@
 /*
  * Eternal variable declarations.
  */
-extern int max_order;
 extern int flushing_enabled;
 
 #include "string16.h"
 #include "coder.h"
+#include "arena.h"		// each model has its own arena
+#include "alphabet.h"	// ... and its own alphabet
 
 /*
  * Definitions
@@ -25,7 +26,18 @@ extern int flushing_enabled;
 #define MAX_MODEL_COUNT	500		// used in count_model
 #define true 1
 #define false 0
-#define MAX_STRING_LENGTH	30000
+#define TEST_CHUNK_LENGTH	4096		// test files are read this many symbols at a time
+#define TRAIN_CHUNK_LENGTH	4096		// ... and training files this many (an even number)
+#define HASH_THRESHOLD	48			// tables with more symbols than this get a hash index
+#define MIN_TABLE_CAPACITY	4		// symbols a table has room for when it is first grown
+
+/*
+ * Counts are 16 bits, so with the 16-bit symbol ids a table entry
+ * takes 4 bytes.  update_table() rescales a table (see
+ * rescale_saturated_table()) before any count can go past MAX_COUNT.
+ */
+typedef unsigned short COUNT_TYPE;
+#define MAX_COUNT	0xFFFF
 
 // The symbols rangs for the binary box strings
 // (from build_16bit_boxstrings.py)
@@ -60,16 +72,18 @@ extern int flushing_enabled;
  * context of "Zor" might have only had 2 different characters
  * appear.  't' might have appeared 10 times, and 'l' might have
  * appeared once.  These two counts are stored in the context
- * table.  The counts are stored in the STATS structure.  All of
- * the counts for a given context are stored in and array of STATS.
- * As new characters are added to a particular contexts, the STATS
- * array will grow.  Sometimes, the STATS array will shrink
- * after flushing the model.
+ * table.  The symbols and their counts are kept in two parallel
+ * arrays, symbols[] and counts[], so that symbols[i] has been seen
+ * counts[i] times.  Keeping the symbols in their own contiguous array
+ * (instead of an array of symbol/count structures) lets the symbol
+ * searches compare several symbols at once (see find_symbol16()).
+ * As new characters are added to a particular contexts, the
+ * arrays will grow.  Sometimes, the arrays will shrink
+ * after flushing the model.  The arrays have room for capacity symbols,
+ * which doubles whenever it runs out, so that a table with n symbols
+ * is only reallocated log(n) times; shrink_model() trims the spare room
+ * off at the end of training.
  */
-typedef struct {
-                SYMBOL_TYPE symbol;	// was unsigned char
-                int counts;			// was 'unsigned char', but rescaling set some level 0 counts to 0
-               } STATS;
 
 /*
  * Each context has to have links to higher order contexts.  These
@@ -79,11 +93,14 @@ typedef struct {
  * then LINKS array.  At that table, we find the "B" link and go to
  * that table.  The process continues until the destination table is
  * found.  The table pointed to by the LINKS array corresponds to the
- * symbol found at the same offset in the STATS table.  The reason that
- * LINKS is in a separate structure instead of being combined with
- * STATS is to save space.  All of the leaf context nodes don't need
+ * symbol found at the same offset in the symbols[] array.  The reason that
+ * LINKS is in a separate array instead of being combined with
+ * the symbols and counts is to save space.  All of the leaf context nodes don't need
  * next pointers, since they are in the highest order context.  In the
- * leaf nodes, the LINKS array is a NULL pointers.
+ * leaf nodes, the LINKS array is a NULL pointers.  A single link can
+ * also be NULL, if the context hasn't been seen yet or if its table
+ * was thrown away by prune_model() to keep the model inside its memory
+ * budget.
  */
 typedef struct {
                  struct context *next;
@@ -91,11 +108,11 @@ typedef struct {
 
 /*
  * The CONTEXT structure holds all of the known information about
- * a particular context.  The links and stats pointers are discussed
- * immediately above here.  The max_index element gives the maximum
- * index that can be applied to the stats or link array.  When the
- * table is first created, and stats is set to NULL, max_index is set
- * to -1.  As soon as single element is added to stats, max_index is
+ * a particular context.  The links, symbols and counts pointers are
+ * discussed immediately above here.  The max_index element gives the maximum
+ * index that can be applied to the symbols, counts or links arrays.  When the
+ * table is first created, and the arrays are set to NULL, max_index is set
+ * to -1.  As soon as single symbol is added, max_index is
  * incremented to 0.
  *
  * The lesser context pointer is a navigational aid.  It points to
@@ -104,15 +121,196 @@ typedef struct {
  * point to "BC".  The reason for maintaining this pointer is that
  * this particular bit of table searching is done frequently, but
  * the pointer only needs to be built once, when the context is
- * created.
+ * created.  lesser_refs counts the tables that point back to this
+ * one, so that prune_model() knows when a table can be thrown away
+ * without leaving some other table's lesser_context pointing at nothing.
+ *
+ * The order element is set when the table is created.  It is used
+ * to charge the memory for the table to the right order when the
+ * model's memory use is reported.
+ *
+ * Tables with lots of symbols (the order-0 table and the time-slot
+ * tables can have hundreds) also get a hash index, so that finding a
+ * symbol doesn't mean searching the whole symbols[] array.  hash[] is
+ * an open-addressing table of hash_size cells (a power of 2); each cell
+ * holds the offset of a symbol in symbols[], or -1 if it is empty.
+ * The hash only records where each symbol is, so the symbols stay in
+ * their sorted order.  Small tables don't have a hash (hash is NULL and
+ * hash_size is 0) because a linear search is faster for them.
  */
 typedef struct context {
                          int max_index;
+                         int capacity;		// room in the symbols, counts (and links) arrays
+                         int order;		// order of this context (-2 .. max_order)
                          LINKS __handle *links;
-                         STATS __handle *stats;
+                         SYMBOL_TYPE __handle *symbols;	// was an array of STATS {symbol, counts}
+                         COUNT_TYPE __handle *counts;	// was 'unsigned char', but rescaling set some level 0 counts to 0 (then int)
+                         int hash_size;			// number of cells in hash[] (0 if no hash)
+                         int lesser_refs;		// number of tables whose lesser_context is this one
+                         int __handle *hash;		// symbol -> offset index for big tables
                          struct context *lesser_context;
                        } CONTEXT;
 
+/*
+ * Once training is done, freeze_model() compiles the tree of CONTEXT
+ * tables into a frozen model: one contiguous, read-only block, which is
+ * all that the prediction and log-loss routines ever look at.  (The
+ * first query freezes the model if it hasn't been frozen.)  The block
+ * starts with a FROZEN_HEADER, which gives the number of elements in
+ * each of the arrays that follow it:
+ *
+ *   FROZEN_NODE nodes[ num_nodes ]        one per context table
+ *   SYMBOL_TYPE symbols[ num_entries ]    every table's symbols, end to end
+ *   COUNT_TYPE counts[ num_entries ]      the matching counts
+ *   int cumulative[ num_entries ]         each entry's count plus the counts of
+ *                                         the entries after it in its node
+ *   int child[ num_entries ]              node number of the table that the
+ *                                         entry links to (-1 for no link)
+ *   int hash_cells[ num_hash_cells ]      the hash indexes of the big tables
+ *   SYMBOL_TYPE codes[ num_codes ]        the alphabet (id -> symbol code)
+ *
+ * Each array starts on an 8-byte boundary.  Node 0 is the control table
+ * (order -2), node 1 is the null table (order -1) and node 2 is the
+ * order 0 table.  The rest follow breadth-first, so the children of a
+ * table are numbered together, and the lower orders come first.
+ * The entries of a node are symbols[ first .. first+max_index ], in the
+ * same (count sorted) order as in the CONTEXT table.  A node's lesser is
+ * the node number of its lesser context, like lesser_context in CONTEXT.
+ */
+typedef struct {
+                int first;		// index of the node's first entry
+                int max_index;		// same as max_index in CONTEXT
+                int order;		// order of the context
+                int scale_shift;	// for coding, the counts are shifted right this many places ...
+                int scaled_max_index;	// ... and only go up to here (see scale_frozen_node())
+                int hash_first;		// index of the node's hash in hash_cells[]
+                int hash_size;		// number of hash cells (0 if no hash)
+                int lesser;		// node number of the lesser context (-1 for the control table)
+               } FROZEN_NODE;
+
+typedef struct {
+                int max_order;		// max_order the model was built with
+                int num_nodes;
+                int num_entries;
+                int num_hash_cells;
+                int num_codes;
+                size_t image_bytes;	// size of the whole block, header included
+               } FROZEN_HEADER;
+
+/*
+ * FROZEN_MODEL points into the block, which never changes once it has
+ * been built.
+ */
+typedef struct {
+                FROZEN_HEADER *image;	// the block (NULL if the model isn't frozen)
+                FROZEN_NODE *nodes;
+                SYMBOL_TYPE *symbols;
+                COUNT_TYPE *counts;
+                int *cumulative;
+                int *child;
+                int *hash_cells;
+                SYMBOL_TYPE *codes;
+                void *mapping;		// start of the mapped model file, if the block is mapped
+                size_t mapping_bytes;	// length of the mapping
+               } FROZEN_MODEL;
+
+/*
+ * save_model() writes the frozen model to a file, so that later runs can
+ * load_model() it instead of training all over again.  The file is a
+ * MODEL_FILE_HEADER followed by the frozen model's block, byte for byte,
+ * so loading it is a single read.  (This also means the file can only be
+ * read on the same kind of machine that wrote it.)  The version number
+ * must be changed whenever the layout of the block changes.
+ *
+ * The block holds no pointers (everything is an index), so it doesn't
+ * even have to be read: where the system has mmap(), load_model() maps
+ * the file read-only and queries use the block right where it sits in
+ * the page cache.  Every process that loads the same file shares that
+ * one copy.  (Build with NO_MMAP defined to always read the file.)
+ */
+#define MODEL_FILE_MAGIC	0x564B4D50	// "PMKV"
+#define MODEL_FILE_VERSION	5		// 2: counts are COUNT_TYPE (were int)
+						// 3: nodes have a lesser node
+						// 4: cumulative counts
+						// 5: nodes carry their rescale, not has_links
+
+typedef struct {
+                int magic;		// MODEL_FILE_MAGIC
+                int version;		// MODEL_FILE_VERSION
+                int symbol_bytes;	// sizeof( SYMBOL_TYPE )
+                int research_question;	// WHERE or WHEN (see predict.h)
+               } MODEL_FILE_HEADER;
+
+/*
+ * A MODEL holds everything about one model: its context tables (which
+ * all live in the model's own arena), its alphabet, the frozen copy if
+ * there is one, and the counters that print_model_allocation() shows.
+ * Every routine in model-2.c is given the model to work on, so a program
+ * can have as many models as it likes.  A MODEL that is all zeros is an
+ * empty model, ready for initialize_model(), and free_model() leaves it
+ * that way again.
+ *
+ * contexts[] (indexed from -2 up to max_order) and current_order belong
+ * to training: they are the contexts that the next symbol will be added
+ * to.  The queries keep their own in a MODEL_SCRATCH (see below).
+ */
+typedef struct {
+                int max_order;		// highest order context kept by the model
+                CONTEXT **contexts;	// current training contexts, -2 .. max_order
+                int current_order;	// order being trained (see clear_current_order())
+                ARENA arena;		// every table, and every array of a table
+                long *order_bytes;	// arena bytes used by the tables of each order, -2 .. max_order
+                ALPHABET alphabet;	// symbol codes <-> the ids kept in the tables
+                FROZEN_MODEL frozen;	// the frozen copy (frozen.image is NULL if there isn't one)
+                int alloc_count;	// number of CONTEXT structs allocated
+                long table_reallocs;	// table array reallocations done (see grow_table())
+                long table_reallocs_avoided;	// ... and the ones that spare capacity saved
+                long saturated_rescales;	// tables rescaled because a count hit MAX_COUNT
+                long memory_budget;	// most arena bytes the model may use (0 for no limit)
+                size_t prune_limit;	// arena use that sets off the next prune_model()
+                long tables_pruned;	// tables thrown away by prune_model()
+                long prune_runs;	// number of times prune_model() has run
+               } MODEL;
+
+/*
+ * A MODEL_SCRATCH holds what a query works with while it runs: the
+ * contexts that traverse_tree() finds (as node numbers in the frozen
+ * model), the order the query is at, the cumulative totals of the node
+ * being used, and the scoreboard of symbols that have to be excluded
+ * from the lower orders (with a list of the symbols it has set, so the
+ * exclusions can be taken off of a node's cumulative counts one by one,
+ * see frozen_interval()).  A query of a frozen model only changes its
+ * scratch, so two threads can query the same frozen model at once if
+ * each has its own scratch.  (A query freezes a model that isn't frozen
+ * yet, so a model has to be frozen before it is shared.)
+ *
+ * A scratch also carries a rolling context for queries that walk along
+ * a string one symbol at a time: reset_context() starts it at order 0,
+ * advance_context() moves it along by one symbol (following the lesser
+ * context links, the same way training does), and predict_from_context()
+ * predicts from it, without ever walking down from the order 0 table.
+ *
+ * initialize_scratch() has to be called before a scratch is used, since
+ * contexts points into the scratch's own array (so a scratch can't be
+ * copied, either).  totals[] and scoreboard[] grow as
+ * they are needed.  clear_scoreboard() just starts a new epoch, so the
+ * scoreboard never has to be wiped between symbols.
+ */
+typedef struct {
+                int contexts_array[ 10 ];
+                int *contexts;		// contexts_array + 2: node numbers, indexed from -2
+                int current_order;
+                short int *totals;
+                int totals_size;		// number of entries allocated in totals[]
+                unsigned int *scoreboard;	// per symbol: the epoch it was last excluded in
+                unsigned int epoch;		// a symbol is excluded if its scoreboard[] entry is this
+                int scoreboard_size;		// number of entries allocated in scoreboard[] (and excluded[])
+                SYMBOL_TYPE *excluded;		// the symbols set in scoreboard[], in the order they were set
+                int num_excluded;
+                int context_node;		// the rolling context's node number ...
+                int context_order;		// ... and its order
+               } MODEL_SCRATCH;
+
 /*
  * This structure holds the results of a prediction, including the predicted
  * next symbol and it's probability (prob_numerator/prob_denominator).
@@ -140,31 +338,80 @@ typedef struct {
 	//unsigned char context_string_used[MAX_DEPTH];
 	int depth;				// context level at which this prediction was made
 	int num_predictions;	// number of elements in sym[] array.
+	int num_candidates;		// number of predictions the context has (up to MAX_NUM_PREDICTIONS);
+							// num_predictions is smaller if the prediction stopped early
     int prob_denominator;	// denominator of the probability
 } STRUCT_PREDICTION;
 
+/*
+ * A PREDICTION_VIEW is a prediction that hasn't been copied out of the
+ * model: it points at the context's own symbols and counts, which are
+ * already sorted most likely first, so it takes no time to make and is
+ * small enough to keep thousands of them at once.  VIEW_SYMBOL() and
+ * VIEW_COUNT() read the i'th prediction (0 .. num_predictions-1) the
+ * way sym[i].symbol and sym[i].prob_numerator read a STRUCT_PREDICTION.
+ * A view is only good until the model changes.
+ */
+typedef struct {
+	const SYMBOL_TYPE *symbols;		// the context's symbol ids
+	const COUNT_TYPE *counts;		// ... and their counts
+	const SYMBOL_TYPE *codes;		// the model's alphabet (id -> symbol code)
+	int depth;				// context level at which this prediction was made
+	int num_predictions;	// number of predictions in the view
+	int num_candidates;		// as in STRUCT_PREDICTION
+	int prob_denominator;	// denominator of the probability
+} PREDICTION_VIEW;
+
+#define VIEW_SYMBOL( v, i )	( (v)->codes[ (v)->symbols[ i ] ] )
+#define VIEW_COUNT( v, i )	( (v)->counts[ i ] )
+
+// A probability mass that a prediction never reaches, so it lists
+// every symbol (up to its limit on the number of them).
+#define ALL_OF_THE_MASS		2.0
+
 
 /*
  * Prototypes for routines that can be called from MODEL-X.C
  */
-void initialize_model( void );
-void update_model( SYMBOL_TYPE symbol );
-void clear_current_order(void);
-int convert_int_to_symbol( SYMBOL_TYPE c, SYMBOL *s );
-//void get_symbol_scale( SYMBOL *s );
+void initialize_model( MODEL *model, int max_order );
+void reset_model( MODEL *model );
+void free_model( MODEL *model );
+void initialize_scratch( MODEL_SCRATCH *scratch );
+void free_scratch( MODEL_SCRATCH *scratch );
+void freeze_model( MODEL *model );
+void thaw_model( MODEL *model );
+void take_frozen_model( MODEL *dest, MODEL *src );
+void shrink_model( MODEL *model );
+void set_memory_budget( MODEL *model, long bytes );
+void prune_model( MODEL *model );
+int save_model( MODEL *model, char *file_name, int research_question );
+int load_model( MODEL *model, char *file_name, int *research_question );
+void update_model( MODEL *model, SYMBOL_TYPE symbol );
+void clear_current_order( MODEL *model );
+int convert_int_to_symbol( MODEL *model, MODEL_SCRATCH *scratch, SYMBOL_TYPE c, SYMBOL *s );
+//void get_symbol_scale( MODEL *model, MODEL_SCRATCH *scratch, SYMBOL *s );
 //int convert_symbol_to_int( int count, SYMBOL *s );
-void add_character_to_model( SYMBOL_TYPE c );
-void flush_model( void );
-void recursive_count(int depth,  CONTEXT *table, int research_question, int verbose );
-void count_model(int research_question, int verbose);
-void print_model(void);
-void recursive_print( int depth, CONTEXT * table);
-float probability( SYMBOL_TYPE c, STRING16 * context_string, char verbose);
-unsigned char predict_next(STRING16 * context_string, STRUCT_PREDICTION * results);
-void print_model_allocation();
-void traverse_tree( STRING16 * context_string);
-void clear_scoreboard(void);
-float compute_logloss( STRING16 * test_string, int verbose);
+void add_character_to_model( MODEL *model, SYMBOL_TYPE c );
+void flush_model( MODEL *model );
+void recursive_count( MODEL *model, int depth, CONTEXT *table, int research_question, int verbose );
+void count_model( MODEL *model, int research_question, int verbose);
+void print_model( MODEL *model );
+void recursive_print( MODEL *model, int depth, CONTEXT * table);
+float probability( MODEL *model, MODEL_SCRATCH *scratch, SYMBOL_TYPE c, STRING16 * context_string, char verbose);
+unsigned char predict_next( MODEL *model, MODEL_SCRATCH *scratch, STRING16 * context_string, STRUCT_PREDICTION * results);
+void print_model_allocation( MODEL *model );
+void traverse_tree( MODEL *model, MODEL_SCRATCH *scratch, STRING16 * context_string);
+void reset_context( MODEL *model, MODEL_SCRATCH *scratch );
+void advance_context( MODEL *model, MODEL_SCRATCH *scratch, SYMBOL_TYPE c );
+unsigned char predict_from_context( MODEL *model, MODEL_SCRATCH *scratch, STRUCT_PREDICTION * results);
+unsigned char predict_top_k( MODEL *model, MODEL_SCRATCH *scratch, int k, STRUCT_PREDICTION * results);
+unsigned char predict_until_mass( MODEL *model, MODEL_SCRATCH *scratch, float mass, STRUCT_PREDICTION * results);
+void predict_view( MODEL *model, MODEL_SCRATCH *scratch, int k, float mass, PREDICTION_VIEW *view );
+void predict_view_at_order( MODEL *model, MODEL_SCRATCH *scratch, int order, int k, float mass, PREDICTION_VIEW *view );
+void clear_scoreboard( MODEL *model, MODEL_SCRATCH *scratch );
+float compute_logloss( MODEL *model, MODEL_SCRATCH *scratch, FILE *test_file, int verbose);
+void compute_logloss_orders( MODEL *model, MODEL_SCRATCH *scratch, FILE *test_file, int verbose,
+                             int num_orders, const int *orders, float *logloss);
 
 
 
@@ -0,0 +1,176 @@
+/*******************************************************
+ * pool.c
+ *
+ * This module runs a batch of independent jobs on a pool
+ * of worker threads, with work stealing.  See pool.h.
+ *
+ * *****************************************************/
+#include <stdlib.h>			// for calloc(), free()
+#include "pool.h"
+
+/* What each thread is given: its pool and its worker number. */
+typedef struct {
+	POOL *pool;
+	int worker;
+} POOL_WORKER;
+
+/* take_job - take the job at the head of worker w's own deque.
+ * Returns -1 if it's empty.
+ */
+static int take_job( POOL *p, int w) {
+	POOL_DEQUE *d = &p->deques[ w ];
+	int job = -1;
+
+	pthread_mutex_lock( &d->lock);
+	if (d->head < d->tail)
+		job = d->jobs[ d->head++ ];
+	pthread_mutex_unlock( &d->lock);
+	return (job);
+}
+
+/* steal_job - take the job at the tail of some other worker's deque,
+ * trying the workers after w in turn.  Returns -1 if every deque is
+ * empty.  No jobs are added once the pool has started, so then there
+ * is nothing left to do.
+ */
+static int steal_job( POOL *p, int w) {
+	POOL_DEQUE *d;
+	int i;
+	int job = -1;
+
+	for (i = 1; i < p->num_workers && job < 0; i++) {
+		d = &p->deques[ (w + i) % p->num_workers ];
+		pthread_mutex_lock( &d->lock);
+		if (d->head < d->tail)
+			job = d->jobs[ --d->tail ];
+		pthread_mutex_unlock( &d->lock);
+	}
+	return (job);
+}
+
+/* run_worker - the body of each thread: run jobs until there are none left. */
+static void * run_worker( void *arg) {
+	POOL_WORKER *me = (POOL_WORKER *) arg;
+	POOL *p = me->pool;
+	int job;
+	int stolen;
+
+	for ( ; ; ) {
+		stolen = 0;
+		job = take_job( p, me->worker);
+		if (job < 0) {
+			job = steal_job( p, me->worker);
+			stolen = 1;
+		}
+		if (job < 0)
+			break;
+		p->run( p->context, me->worker, job);
+		pthread_mutex_lock( &p->done_lock);
+		p->done[ job ] = 1;
+		p->num_steals += stolen;
+		pthread_cond_broadcast( &p->done_signal);
+		pthread_mutex_unlock( &p->done_lock);
+	}
+	return (NULL);
+}
+
+/* free_pool - give back the pool's memory (but not its locks). */
+static void free_pool( POOL *p) {
+	int w;
+
+	if (p->deques != NULL)
+		for (w = 0; w < p->num_workers; w++)
+			free( p->deques[ w ].jobs);
+	free( p->deques);
+	free( p->threads);
+	free( p->done);
+	free( p->workers);
+	p->deques = NULL;
+	p->threads = NULL;
+	p->done = NULL;
+	p->workers = NULL;
+}
+
+/* pool_start - start num_workers threads running jobs 0 .. num_jobs-1.
+ * The jobs are dealt out in the given order (or 0, 1, 2, ... if order
+ * is NULL), round robin, so each worker starts on the jobs that come
+ * first in it.  Putting the longest jobs first keeps the tail short.
+ * If some of the threads can't be started, the others steal their
+ * jobs.  Returns false if none of them can be (or memory runs out),
+ * and then the pool mustn't be waited for.
+ */
+int pool_start( POOL *p, int num_workers, int num_jobs, const int *order,
+                POOL_JOB_FUNCTION run, void *context ) {
+	POOL_WORKER *workers;
+	POOL_DEQUE *d;
+	int i, w;
+
+	if (num_workers > num_jobs)
+		num_workers = num_jobs;
+	if (num_workers < 1)
+		num_workers = 1;
+	p->num_workers = num_workers;
+	p->num_threads = 0;
+	p->num_jobs = num_jobs;
+	p->run = run;
+	p->context = context;
+	p->num_steals = 0;
+	p->deques = (POOL_DEQUE *) calloc( num_workers, sizeof( POOL_DEQUE));
+	p->threads = (pthread_t *) calloc( num_workers, sizeof( pthread_t));
+	p->done = (unsigned char *) calloc( num_jobs + 1, sizeof( unsigned char));
+	p->workers = workers = (POOL_WORKER *) calloc( num_workers, sizeof( POOL_WORKER));
+	if (p->deques == NULL || p->threads == NULL || p->done == NULL || workers == NULL) {
+		free_pool( p);
+		return (0);
+	}
+	for (w = 0; w < num_workers; w++) {
+		p->deques[ w ].jobs = (int *) calloc( num_jobs / num_workers + 1, sizeof( int));
+		if (p->deques[ w ].jobs == NULL) {
+			free_pool( p);
+			return (0);
+		}
+	}
+	for (i = 0; i < num_jobs; i++) {
+		d = &p->deques[ i % num_workers ];
+		d->jobs[ d->tail++ ] = (order != NULL) ? order[ i ] : i;
+	}
+	for (w = 0; w < num_workers; w++)
+		pthread_mutex_init( &p->deques[ w ].lock, NULL);
+	pthread_mutex_init( &p->done_lock, NULL);
+	pthread_cond_init( &p->done_signal, NULL);
+
+	for (w = 0; w < num_workers; w++) {
+		workers[ p->num_threads ].pool = p;
+		workers[ p->num_threads ].worker = w;
+		if (pthread_create( &p->threads[ p->num_threads ], NULL, run_worker, &workers[ p->num_threads ]) == 0)
+			p->num_threads++;
+	}
+	if (p->num_threads == 0) {
+		pool_finish( p);
+		return (0);
+	}
+	return (1);
+}
+
+/* pool_wait_for - wait until the given job has been run. */
+void pool_wait_for( POOL *p, int job ) {
+	pthread_mutex_lock( &p->done_lock);
+	while (!p->done[ job ])
+		pthread_cond_wait( &p->done_signal, &p->done_lock);
+	pthread_mutex_unlock( &p->done_lock);
+}
+
+/* pool_finish - wait for all of the jobs to be run, then stop the
+ * threads and free the pool's memory.
+ */
+void pool_finish( POOL *p ) {
+	int w;
+
+	for (w = 0; w < p->num_threads; w++)
+		pthread_join( p->threads[ w ], NULL);
+	for (w = 0; w < p->num_workers; w++)
+		pthread_mutex_destroy( &p->deques[ w ].lock);
+	pthread_mutex_destroy( &p->done_lock);
+	pthread_cond_destroy( &p->done_signal);
+	free_pool( p);
+}
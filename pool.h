@@ -0,0 +1,59 @@
+/**************************************************
+ * pool.h
+ *
+ * Prototypes for a pool of worker threads that runs a batch
+ * of independent jobs.  The jobs are dealt out to the workers
+ * up front, one deque of job numbers per worker.  A worker
+ * runs the jobs at the head of its own deque, and when that
+ * runs dry it steals from the tail of another worker's, so
+ * no worker sits idle while there are jobs left anywhere
+ * (however long the jobs are).  The caller can wait for the
+ * jobs one at a time, so results can be used in job order
+ * while the later jobs are still running.
+ *
+ * ************************************************/
+
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <pthread.h>
+
+/*
+ * A POOL_JOB_FUNCTION runs job number 'job' on worker number 'worker'
+ * (0 .. num_workers-1, so per-worker state can be kept in an array).
+ * The context is the one given to pool_start().
+ */
+typedef void (*POOL_JOB_FUNCTION)( void *context, int worker, int job );
+
+/*
+ * One worker's jobs: jobs[head .. tail-1] are still to be run.
+ * The owner takes them from the head, thieves from the tail.
+ */
+typedef struct {
+	pthread_mutex_t lock;		// guards head and tail
+	int *jobs;					// job numbers
+	int head, tail;
+} POOL_DEQUE;
+
+typedef struct {
+	int num_workers;			// number of deques
+	int num_threads;			// number of threads running them (normally the same)
+	int num_jobs;
+	POOL_JOB_FUNCTION run;		// what to do with each job
+	void *context;				// ... and its first argument
+	POOL_DEQUE *deques;			// one per worker
+	pthread_t *threads;			// one per worker
+	void *workers;				// each thread's POOL and worker number
+	pthread_mutex_t done_lock;	// guards done[]
+	pthread_cond_t done_signal;	// broadcast whenever a job is done
+	unsigned char *done;		// done[j] is true once job j has been run
+	int num_steals;				// how many jobs were run by a worker they weren't dealt to
+} POOL;
+
+/* Function Prototypes */
+int pool_start( POOL *p, int num_workers, int num_jobs, const int *order,
+                POOL_JOB_FUNCTION run, void *context );
+void pool_wait_for( POOL *p, int job );
+void pool_finish( POOL *p );
+
+#endif /*POOL_H_*/
@@ -18,6 +18,10 @@
  *
  *  -f text_file_name  [defaults to test.inp]
  *  -o order [defaults to 3 for model-2]
+ *  -o order,order,...			# Sweep the orders: train one model, with the highest of them, and test it as if
+ *  							# it had each of them in turn, in one pass over the test file (-p or -logloss).
+ *  							# Each order's -p results are printed in an <Order> element.  (With -load_model,
+ *  							# the orders can go up to the saved model's.)
  *  -logloss test_file_name    	# Calculate average-log loss for the given test string.
  *  -p test_file_name			# Run a prediction for each char of given test string.
  *  -v							# verbose mode (prints extra info to stdout
@@ -33,6 +37,25 @@
  * 								# use all predictions whose probabilities sum to greater than or equal to the confidence 
  * 								# level.  Ex. If confidence level is 80% and the predictions returned 75%, 15%, 10%, it would
  * 								# use the first two predictions (sum=90%) but not the third.
+ * -c all						# Test every confidence level from 0 to 100 in one run (WHEN case only), and print
+ * 								# a table of the number correct and the number of predictions used at each.
+ * -save_model model_file_name	# After training, save the model (and max_order and the research question) to a file.
+ * -load_model model_file_name	# Load a model saved with -save_model instead of training one.  -f, -o and -when
+ * 								# aren't needed (the saved values are used).
+ * -memory_budget kilobytes		# Keep the model inside this much memory while training, by pruning
+ * 								# the high order contexts that have been seen the least.
+ * -batch batch_file_name		# Run every job in the file (instead of -f and -p or -logloss), each line being
+ * 								# p|logloss training_file test_file order [confidence_level]
+ * 								# The jobs run at the same time, and each one's results are printed (in order) in
+ * 								# a <Job> element.  The other options (-when, -c, ...) apply to every job.
+ * -threads number_of_threads	# How many -batch jobs (or -cv folds) to run at once (defaults to the number of processors).
+ * -cv number_of_segments		# Cross-validate on the -f file (instead of -p or -logloss): cut it into that many
+ * -cv offset,offset,...		# equal segments, or at the given symbol offsets (say, the week boundaries; put a comma
+ * 								# after a single offset), and for each segment after the first, train a model on the
+ * 								# segments before it and test it on that segment.  Each fold's -p results and log-loss
+ * 								# are printed together in a <Fold> element.  The file is read once, the folds' models
+ * 								# are trained one from the next in one pass over it, and the folds run at the same time.
+ * -cv_window number_of_segments	# Train each -cv fold on only the segments just before its test segment.
  *
  * *
  * 22Apr2010 ink Number of predictions are written to num_pred.xml
@@ -53,6 +76,9 @@
 #include "predict.h"
 #include "string16.h"
 #include "mapping.h"	// for ap mapping, ap neighbors, timeslot mapping
+#include "pool.h"		// for running -batch jobs on a pool of threads
+#include <unistd.h>		// for sysconf()
+#include <sys/stat.h>	// for stat()
 char str_representations[][21]={"Unknown","Locstrings","Loctimestrings","Boxstrings","Binboxstrings", "BinDOWts"};
 char str_mappings[][6] = {"LOC", "STRT", "DUR", "DELIM"};
 
@@ -64,9 +90,16 @@ FILE *training_file;		// File containing string to train on.
 FILE *test_file;			// File to test against (form future predictions)
 FILE *num_pred_file;		// file to write out the number of predictions
 							// returned for each test.
+RESULTS_WRITER results_writer;	// ... which is written on a background thread (see writer.h)
 FILE *time_deltas_file;		// file to write out the time difference between
 							// time predictions andthe right answer.
 char test_file_name[ 81 ];
+char save_model_file_name[ 81 ];	// -save_model: write the trained model here
+char load_model_file_name[ 81 ];	// -load_model: read the model from here instead of training
+FILE *batch_file;			// -batch: the jobs to run
+int num_threads = 0;		// -threads: how many of them to run at once (0 for one per processor)
+char *cv_segments;			// -cv: the number of segments, or the offsets of the boundaries between them
+int cv_window = 0;			// -cv_window: how many segments each fold is trained on (0 for all before it)
 
 char verbose = FALSE;		// if true, print out lots of info
 int confidence_level = -1;	// 0 < value < 100, -1 means don't use it.
@@ -78,36 +111,10 @@ int confidence_level = -1;	// 0 < value < 100, -1 means don't use it.
 int  representation;		// specified with -input_type argument.
 int  research_question;		// WHERE or WHEN will someone be next.
 
-/*
- * Counters used to count up the results of the predictions
- */
-int num_tested=0, num_right=0;		// test results
-int NumTests = 0;
-int FallbackNumCorrect = 0;  // number of times it fell to level 0 and was still right.
-int FallbackNum = 0;	// number of times model went to level 0 for a prediction
-//Counters for most likely predictions
-int MostProb_NumCorrect = 0;		// # times one of the most probably predictions was right
-									// (also used to count confidence_level predictions)
-int MostProb_NeighborCorrect = 0;	// number of times the most prob prediction was wrong, but one of
-									// it's neighboring APs is correct answer (WHERE only)
-int MostProb_Within10Minutes = 0;	// (WHERE case) # times right answer within 10 minutes of one
-									// of the predictions
-int MostProb_Within20Minutes = 0;	// (WHERE case) # times right answer is within 20 minutes of
-									// one of the most likely predictions
-int MostProb_MultiplePredictions = 0; // # times the Most Probable list included > 1 prediction.
-// Counters for the less likely predictions
-int LessProb_NumCorrect = 0;		// # times one of the less probable predictions was right
-int LessProb_NeighborCorrect = 0;	// number of times one of the less prob prediction was wrong, but one of
-									// it's neighboring APs is correct answer (WHERE only)
-int LessProb_Within10Minutes = 0;	// (WHERE case) # times right answer within 10 minutes of one
-									// of the predictions
-int LessProb_Within20Minutes = 0;	// (WHERE case) # times right answer is within 20 minutes of
-									// one of the most likely predictions
-int LessProb_MultiplePredictions = 0; // # times the Less Probable list included > 1 prediction.
-
-int number_multiple_predictions = 0; //number fo times model made > 1 prediction for a given time.
-int number_times_neighbors_are_correct = 0;	// number of times the prediction is a neighbor of actual
-STRUCT_PREDICTION pred;			// structure containing predictions
+int max_order=3;			// -o: the order of the model to train
+int sweep_orders[ MAX_SWEEP_ORDERS ];	// -o: the orders to test it with, if it's an order sweep
+int num_sweep_orders = 0;	// ... and how many of them there are
+long memory_budget_kb=0;	// -memory_budget: the model's memory budget (0 for none)
 
 /*
  * The main procedure is similar to the main found in COMP-1.C.
@@ -131,9 +138,12 @@ STRUCT_PREDICTION pred;			// structure containing predictions
  */
 int main( int argc, char **argv )
 {
-     SYMBOL_TYPE c, c1, c2;
      int function;		// function to perform
-     STRING16 * test_string;
+     MODEL model;		// the model
+     MODEL_SCRATCH scratch;	// what the queries on the model work with
+     JOB jobs[ MAX_SWEEP_ORDERS ];	// what to do with it (a job for each order of a sweep)
+     int num_jobs;		// number of jobs
+     float logloss[ MAX_SWEEP_ORDERS ];	// the log-loss for each order of a sweep
 
      int i;				// general purpose register
 
@@ -145,15 +155,51 @@ int main( int argc, char **argv )
     /* Initialize ********************************************/
     printf("<Run>\n");			// start of XML element
      function = initialize_options( --argc, ++argv );
-    initialize_model();
-    test_string = string16(MAX_STRING_LENGTH+1);
+    memset( &model, 0, sizeof( model ) );
+    initialize_model( &model, max_order );
+    set_memory_budget( &model, memory_budget_kb * 1024L );
+    initialize_scratch( &scratch );
     
+    results_writer_start( &results_writer );
+    
+    /* Get the model: either load a saved one, or train one on the input training file
+     * (or for a batch, leave it to each of the jobs, and for a cross-validation, to
+     * cross_validate()) */
+    if (function == BATCH_RUN || function == CROSS_VALIDATE)
+    	;
+    else if (load_model_file_name[0] != '\0')	{
+    	if (!load_model( &model, load_model_file_name, &i))	{
+    		printf( "Had trouble loading the model file %s!\n", load_model_file_name );
+    		exit( -1 );
+    		}
+    	if (i != research_question)
+    		fprintf(stderr, "The model in %s was built for the %s question; using that.\n",
+    				load_model_file_name, (i==WHERE)? "WHERE":"WHEN");
+    	research_question = i;
+    	print_research_question();
+    	}
+    else	{
+    	train_model( &model, training_file );
+    	shrink_model( &model );		// trim the spare room off of the tables
+    	/* Training is done, so compile the model into its frozen (read-only) form
+    	 * for the prediction and log-loss code. */
+    	freeze_model( &model );
+    	}
+    if (save_model_file_name[0] != '\0' &&
+    		!save_model( &model, save_model_file_name, research_question))	{
+    	printf( "Had trouble saving the model file %s!\n", save_model_file_name );
+    	exit( -1 );
+    	}
+
 #ifdef COUNT_NUMBER_OF_PREDICTIONS_RETURNED
     /*** Use this code to count the number of predictions returned for each test.
-     * They are written into a separate, comma-delimited file.
+     * They are written into a separate, comma-delimited file.  (Not for -c all,
+     * which only counts them up: see analyze_confidence_levels().)  This comes
+     * after the model is loaded, since that can change the research question.
      */
-    num_pred_file = fopen("num_pred.csv", "a");		// should really check for errors
-    if (ftell(num_pred_file) == 0)  {
+    if (num_pred_lines( confidence_level ) != NO_NUM_PRED_LINES)
+    	num_pred_file = fopen("num_pred.csv", "a");		// should really check for errors
+    if (num_pred_file != NULL && ftell(num_pred_file) == 0)  {
     	//fprintf(num_pred_file, "<?xml version=\"1.0\" standalone=\"yes\" ?>\n");
     	if (confidence_level < 0)
     		fprintf(num_pred_file,"test_file_name, num_best_predictions, num_less_predictions, pred.num_predictions\n");
@@ -164,64 +210,14 @@ int main( int argc, char **argv )
    * End of code to count number of predictions.
    *******************/
 #endif
-    
-    /* Train the model on the given input training file ***********/
-    if (research_question == WHERE) {
-	    for ( ; ; )
-	    {
-     		if (fread(&c, sizeof(SYMBOL_TYPE),1,training_file) == 0)
-    			c = DONE;
-    		/* NOTE: fread() seems to skip over whitespace chars, so be careful what's in your bin file. */
-    		//printf("Training on 0x%04x\n", c);
-            /*** The 16-bit version does not currently support delimiter-removal
-            **  if (strchr(str_delimiters, c) != NULL)	{
-    		** 	//printf("Skipping training on '%c'\n",c);
-    		**	continue;					// This char is a delimiter, go onto the next character
-    		** }
-    		****************/
-	//       if ( c == EOF  || c == '\n' || c == 0x0a)	// skip line feeds
-	//            c = DONE;
-	       	clear_current_order();
-	        if ( c == DONE )
-	        	break;
-	        update_model( c );		//because current order is 0, this updates the counters in the level-0 table (I THINK)
-	        add_character_to_model( c );
-	    }
-    } else {	// research_question == WHEN
-    	// This portion of the code ASSUMES that the input string is a 'binbox' representation
-    	// of the format T1,L1,T2,L2... where Tx is the time for pair x, and Lx is the location at 
-    	// that time.   For the 'when' question, the pairs need to be flipped so that the sequence
-    	// looks like L1,T1,L2,T2, etc.  Instead of re-processing the input data, I'm going to read
-    	// the sequence in pairs and flip them.
-	    for ( ; ; )
-	    {
-     		if (fread(&c1, sizeof(SYMBOL_TYPE),1,training_file) == 0)  // Read first char
-	    		c = DONE;
-	       	clear_current_order();
-	        if ( c == DONE )
-	        	break;
-     		if (fread(&c2, sizeof(SYMBOL_TYPE),1,training_file) == 0)  // Read second char
-	    		c = DONE;
-	        if ( c == DONE )
-	        	break;
-
-	        // Train on second char in pair
-	        update_model( c2 );
-	        add_character_to_model( c2 );
-	        // Train on first char in pair
-	       	clear_current_order();
-	        update_model( c1 );
-	        add_character_to_model( c1 );
-	    }
-    }
 
     /*** Print information about the model */
     if (verbose)  {
-        //print_model_allocation();
-    	//print_model();
+        print_model_allocation( &model );
+    	//print_model( &model );
     										// for this research question
     }
-	//count_model(research_question, verbose);		// print out number of tables and child tables
+	//count_model( &model, research_question, verbose);		// print out number of tables and child tables
 
 	/***************************************/
 
@@ -266,21 +262,45 @@ int main( int argc, char **argv )
 
 	******************************************/
 
+    // A sweep tests the model with each of its orders, otherwise it's tested with its own.
+    num_jobs = (num_sweep_orders > 1) ? num_sweep_orders : 1;
+    for (i = 0; i < num_jobs; i++)	{
+    	memset( &jobs[i], 0, sizeof( JOB ) );
+    	jobs[i].function = function;
+    	strcpy( jobs[i].test_file_name, test_file_name );
+    	jobs[i].max_order = (num_sweep_orders > 1) ? sweep_orders[i] : model.max_order;
+    	jobs[i].confidence_level = confidence_level;
+    	jobs[i].test_file = test_file;
+    	jobs[i].out = stdout;
+    	jobs[i].num_pred_file = num_pred_file;
+    	if (jobs[i].max_order > model.max_order)	{
+    		printf( "Can't test order %d with an order %d model!\n", jobs[i].max_order, model.max_order );
+    		exit( -1 );
+    		}
+    	}
+
 	switch (function)	{
     	case PREDICT_TEST:
-    		// read test file
-    		i = fread16( test_string, MAX_STRING_LENGTH, test_file);
-    		if (i == MAX_STRING_LENGTH)
-    			fprintf(stderr,"Test String may be over max length and may have been truncated.\n");
-    		predict_test(test_string);
+    		// the test file is read as it is tested
+    		if (num_jobs == 1)
+    			predict_test( &model, &scratch, jobs, 1);
+    		else
+    			predict_test_sweep( &model, &scratch, jobs, num_jobs);
+    		break;
+    	case BATCH_RUN:
+    		run_batch();
+    		break;
+    	case CROSS_VALIDATE:
+    		cross_validate( &model );
     		break;
     	case LOGLOSS_EVAL:
-    		// read test file
-    		//fgets(test_string, MAX_STRING_LENGTH, test_file);
-    		i = fread16( test_string, MAX_STRING_LENGTH, test_file);
-    		if (i == MAX_STRING_LENGTH)
-    			fprintf(stderr,"Test String may be over max length and may have been truncated.\n");
-    		printf("%d, %f\n", max_order, compute_logloss(test_string, verbose));
+    		if (num_jobs == 1)
+    			printf("%d, %f\n", model.max_order, compute_logloss( &model, &scratch, test_file, verbose));
+    		else	{
+    			compute_logloss_orders( &model, &scratch, test_file, verbose, num_sweep_orders, sweep_orders, logloss);
+    			for (i = 0; i < num_jobs; i++)
+    				printf("%d, %f\n", sweep_orders[i], logloss[i]);
+    			}
     		break;
      	case NO_FUNCTION:
     	default:
@@ -288,12 +308,522 @@ int main( int argc, char **argv )
     	}
     if (!verbose)
     	printf("</Run>\n");	// End of xml element
+    results_writer_stop( &results_writer );
 #ifdef COUNT_NUMBER_OF_PREDICTIONS_RETURNED
-    fclose(num_pred_file);
+    if (num_pred_file != NULL)
+    	fclose(num_pred_file);
 #endif    
     exit( 0 );
 }
 
+/*
+ * train_model
+ * Train the given model on the input training file, one symbol at a time
+ * (though the file is read a buffer full at a time).
+ * (This is the training loop that used to be in main().)
+ */
+void train_model( MODEL *model, FILE *training_file )
+{
+    SYMBOL_TYPE buffer[ TRAIN_CHUNK_LENGTH ];	// the piece of the training file being trained on
+    const SYMBOL_TYPE *symbols;	// ... which is the buffer, or the whole of the mapped file
+    STRING16 * trace;		// the mapped training file (NULL if it couldn't be mapped)
+    int length;		// number of symbols in the piece
+    int flip = 0;	// 1 if the pairs in the piece are to be flipped as they are read
+    int i;
+
+    /* The training file is mapped if it can be (see map_string16()), and trained
+     * on in one piece.  Otherwise it's read TRAIN_CHUNK_LENGTH symbols at a time.
+     * NOTE: fread() seems to skip over whitespace chars, so be careful what's in your bin file. */
+    trace = map_string16( training_file);
+    do {
+    	if (trace != NULL)	{
+    		symbols = trace->s;
+    		length = strlen16( trace);
+    	}
+    	else	{
+    		symbols = buffer;
+    		length = fread( buffer, sizeof(SYMBOL_TYPE), TRAIN_CHUNK_LENGTH, training_file);
+    	}
+    	if (research_question == WHEN)	{
+	    	// This portion of the code ASSUMES that the input string is a 'binbox' representation
+	    	// of the format T1,L1,T2,L2... where Tx is the time for pair x, and Lx is the location at 
+	    	// that time.   For the 'when' question, the pairs need to be flipped so that the sequence
+	    	// looks like L1,T1,L2,T2, etc.  Instead of re-processing the input data, I'm going to 
+	    	// flip the pairs in the buffer, or (since a mapped file can't be changed) flip
+	    	// the index of each symbol as it's read.  (TRAIN_CHUNK_LENGTH is even, so a pair
+	    	// is only cut in two at the end of the file, and then its first half isn't trained on.)
+    		length &= ~1;
+    		if (trace != NULL)
+    			flip = 1;
+    		else
+    			swap_pairs16( buffer, length);
+    	}
+    	i = train_on_symbols( model, symbols, length, flip);
+    } while (trace == NULL && length == TRAIN_CHUNK_LENGTH && i == length);
+   	clear_current_order( model );
+   	if (trace != NULL)
+   		delete_string16( trace);
+}
+
+/*
+ * train_on_symbols
+ * Train the model on the given symbols, one at a time, flipping each
+ * pair as it's read if flip is 1 (see train_model()).  Returns the
+ * number of symbols trained on, which is less than length if a DONE
+ * symbol ended the WHERE training.
+ */
+int train_on_symbols( MODEL *model, const SYMBOL_TYPE *symbols, int length, int flip )
+{
+    int i;
+
+    for (i=0; i < length; i++)	{
+    	//printf("Training on 0x%04x\n", symbols[i ^ flip]);
+        /*** The 16-bit version does not currently support delimiter-removal
+        **  if (strchr(str_delimiters, c) != NULL)	{
+    	** 	//printf("Skipping training on '%c'\n",c);
+    	**	continue;					// This char is a delimiter, go onto the next character
+    	** }
+    	****************/
+       	clear_current_order( model );
+        if ( research_question == WHERE && symbols[i ^ flip] == DONE )	// (a DONE symbol ends the WHERE training)
+        	break;
+        update_model( model, symbols[i ^ flip] );		//because current order is 0, this updates the counters in the level-0 table (I THINK)
+        add_character_to_model( model, symbols[i ^ flip] );
+    }
+    return( i );
+}
+
+/*
+ * read_batch
+ * Read the -batch file into the batch's list of jobs.  Each line is
+ * 		p|logloss training_file test_file order [confidence_level]
+ * (the confidence level defaults to the -c one, and has to write the
+ * same num_pred.csv columns as it: see num_pred_lines()).  Blank lines
+ * and lines starting with # are skipped.
+ */
+void read_batch( BATCH *batch )
+{
+	char line[ 512 ];
+	char str_function[ 16 ];
+	int line_number = 0;
+	int capacity = 0;
+	int fields;
+	JOB *job;
+
+	batch->jobs = NULL;
+	batch->num_jobs = 0;
+	while (fgets( line, sizeof( line ), batch_file ) != NULL)	{
+		line_number++;
+		if (sscanf( line, "%15s", str_function ) != 1 || str_function[0] == '#')
+			continue;
+		if (batch->num_jobs == capacity)	{
+			capacity = (capacity == 0) ? 64 : 2 * capacity;
+			batch->jobs = (JOB *) realloc( batch->jobs, capacity * sizeof( JOB ) );
+			if (batch->jobs == NULL)	{
+				printf( "Had trouble allocating the batch jobs!\n" );
+				exit( -1 );
+			}
+		}
+		job = &batch->jobs[ batch->num_jobs ];
+		memset( job, 0, sizeof( JOB ) );
+		job->confidence_level = confidence_level;
+		fields = sscanf( line, "%15s %80s %80s %d %d", str_function, job->training_file_name,
+				job->test_file_name, &job->max_order, &job->confidence_level );
+		if (fields == 5 && (job->confidence_level > 100 || job->confidence_level < 0))	// as with -c
+			job->confidence_level = -1;
+		if (strcmp( str_function, "p" ) == 0)
+			job->function = PREDICT_TEST;
+		else if (strcmp( str_function, "logloss" ) == 0)
+			job->function = LOGLOSS_EVAL;
+		else
+			fields = 0;
+		if (fields < 4)	{
+			fprintf( stderr, "Line %d of the batch file should be: p|logloss training_file test_file order [confidence_level]\n",
+					line_number );
+			exit( -1 );
+		}
+		// num_pred.csv has one header, for the -c level, so every job has to write the same columns.
+		if (job->function == PREDICT_TEST && num_pred_lines( job->confidence_level ) != num_pred_lines( confidence_level ))	{
+			fprintf( stderr, "Line %d of the batch file: confidence level %d would write different num_pred.csv columns from -c %d\n",
+					line_number, job->confidence_level, confidence_level );
+			exit( -1 );
+		}
+		batch->num_jobs++;
+	}
+	fclose( batch_file );
+}
+
+/*
+ * The size of a job (for dealing out the biggest ones first) is the
+ * size of its files, and comes first so that qsort() can sort on it.
+ */
+typedef struct {
+	off_t bytes;
+	int job;
+} JOB_SIZE;
+
+int compare_job_sizes( const void *a, const void *b )
+{
+	const JOB_SIZE *size_a = (const JOB_SIZE *) a;
+	const JOB_SIZE *size_b = (const JOB_SIZE *) b;
+
+	if (size_a->bytes != size_b->bytes)
+		return (size_a->bytes < size_b->bytes) ? 1 : -1;	// biggest first
+	return (size_a->job - size_b->job);
+}
+
+/*
+ * run_batch
+ * Run every job in the -batch file on a pool of threads (see pool.h),
+ * biggest jobs first, and print each job's results as soon as it and
+ * every job before it in the file are done, so they come out in the
+ * order of the file.  If the threads can't be started, the jobs are
+ * run here, one at a time.
+ */
+void run_batch( void )
+{
+	BATCH batch;
+	POOL pool;
+	JOB_SIZE *sizes;
+	int *order;
+	int started;
+	struct stat file_status;
+	int j, w;
+
+	read_batch( &batch );
+	if (num_threads <= 0)
+		num_threads = (int) sysconf( _SC_NPROCESSORS_ONLN );
+	if (num_threads <= 0)
+		num_threads = 1;
+
+	sizes = (JOB_SIZE *) calloc( batch.num_jobs + 1, sizeof( JOB_SIZE ) );
+	order = (int *) calloc( batch.num_jobs + 1, sizeof( int ) );
+	batch.models = (MODEL *) calloc( num_threads, sizeof( MODEL ) );	// (all zero, so not set up yet)
+	batch.scratches = (MODEL_SCRATCH *) calloc( num_threads, sizeof( MODEL_SCRATCH ) );
+	if (sizes == NULL || order == NULL || batch.models == NULL || batch.scratches == NULL)	{
+		printf( "Had trouble allocating the batch jobs!\n" );
+		exit( -1 );
+	}
+	for (j = 0; j < batch.num_jobs; j++)	{
+		sizes[j].job = j;
+		if (stat( batch.jobs[j].training_file_name, &file_status ) == 0)
+			sizes[j].bytes += file_status.st_size;
+		if (stat( batch.jobs[j].test_file_name, &file_status ) == 0)
+			sizes[j].bytes += file_status.st_size;
+	}
+	qsort( sizes, batch.num_jobs, sizeof( JOB_SIZE ), compare_job_sizes );
+	for (j = 0; j < batch.num_jobs; j++)
+		order[j] = sizes[j].job;
+	for (w = 0; w < num_threads; w++)
+		initialize_scratch( &batch.scratches[w] );
+
+	started = pool_start( &pool, num_threads, batch.num_jobs, order, run_batch_job, &batch );
+	for (j = 0; j < batch.num_jobs; j++)	{
+		if (started)
+			pool_wait_for( &pool, j );
+		else
+			run_batch_job( &batch, 0, j );
+		fwrite( batch.jobs[j].out_text, 1, batch.jobs[j].out_bytes, stdout );
+#ifdef COUNT_NUMBER_OF_PREDICTIONS_RETURNED
+		if (num_pred_file != NULL)
+			fwrite( batch.jobs[j].num_pred_text, 1, batch.jobs[j].num_pred_bytes, num_pred_file );
+#endif
+		free( batch.jobs[j].out_text );
+		free( batch.jobs[j].num_pred_text );
+	}
+	if (started)
+		pool_finish( &pool );
+
+	for (w = 0; w < num_threads; w++)	{
+		if (batch.models[w].contexts != NULL)
+			free_model( &batch.models[w] );
+		free_scratch( &batch.scratches[w] );
+	}
+	free( batch.models );
+	free( batch.scratches );
+	free( batch.jobs );
+	free( sizes );
+	free( order );
+}
+
+/*
+ * run_batch_job
+ * Run one job of a batch on the given worker, with its results going
+ * into memory until run_batch() prints them.  (This is the pool's
+ * POOL_JOB_FUNCTION.)
+ */
+void run_batch_job( void *context, int worker, int job_number )
+{
+	BATCH *batch = (BATCH *) context;
+	JOB *job = &batch->jobs[ job_number ];
+
+	job->out = open_memstream( &job->out_text, &job->out_bytes );
+	job->num_pred_file = open_memstream( &job->num_pred_text, &job->num_pred_bytes );
+	if (job->out == NULL || job->num_pred_file == NULL)	{
+		printf( "Had trouble allocating the batch jobs!\n" );
+		exit( -1 );
+	}
+	run_job( job, &batch->models[ worker ], &batch->scratches[ worker ] );
+	fclose( job->out );
+	fclose( job->num_pred_file );
+}
+
+/*
+ * run_job
+ * Train a model on the job's training file and test it, just as main()
+ * does for a single run, writing a <Job> element with the same things
+ * in it as a <Run> has.  The model is set up for the first job it's
+ * used for, and reset for the ones after that.
+ */
+void run_job( JOB *job, MODEL *model, MODEL_SCRATCH *scratch )
+{
+	char *str_file;		// the file name part of a path
+
+	fprintf( job->out, "   <Job>\n" );
+	if (job->max_order%2 == 0)
+		fprintf( job->out, "max_order should be an odd value!\n" );
+	if (job->function == PREDICT_TEST)	{
+		str_file = strrchr( job->test_file_name, '/' );
+		str_file = (str_file == NULL) ? job->test_file_name : str_file+1;
+		fprintf( job->out, "   <TestFile>%s</TestFile>\n", str_file );
+		fprintf( job->out, "   <SourceDir>%.*s</SourceDir>\n", (int) (str_file - job->test_file_name), job->test_file_name );
+	}
+	str_file = strrchr( job->training_file_name, '/' );
+	fprintf( job->out, "   <TrainingFile>%s</TrainingFile>\n", (str_file == NULL) ? job->training_file_name : str_file+1 );
+	fprintf( job->out, "   <MaxOrder>%d</MaxOrder>\n", job->max_order );
+
+	job->training_file = fopen( job->training_file_name, "rb" );
+	job->test_file = fopen( job->test_file_name, "rb" );
+	if (job->training_file == NULL)
+		fprintf( job->out, "Had trouble opening the input training file %s!\n", job->training_file_name );
+	else if (job->test_file == NULL)
+		fprintf( job->out, "Had trouble opening the testing file %s!\n", job->test_file_name );
+	else	{
+		if (model->contexts == NULL)	{
+			initialize_model( model, job->max_order );
+			set_memory_budget( model, memory_budget_kb * 1024L );
+		}
+		else	{
+			model->max_order = job->max_order;
+			reset_model( model );		// (keeps the memory budget)
+		}
+		train_model( model, job->training_file );
+		shrink_model( model );
+		freeze_model( model );
+		if (job->function == PREDICT_TEST)
+			predict_test( model, scratch, job, 1 );
+		else
+			fprintf( job->out, "%d, %f\n", model->max_order, compute_logloss( model, scratch, job->test_file, verbose ) );
+	}
+	if (job->training_file != NULL)
+		fclose( job->training_file );
+	if (job->test_file != NULL)
+		fclose( job->test_file );
+	fprintf( job->out, "   </Job>\n" );
+}
+
+/*
+ * read_folds
+ * Cut the training file into the -cv segments, and make a fold for
+ * each segment after the first.  The boundaries are rounded down to an
+ * even offset so a pair is never cut in two.
+ */
+void read_folds( CROSS_VALIDATION *cv )
+{
+	int *boundary;		// segment k is symbols boundary[k] .. boundary[k+1]-1
+	int num_segments;
+	int length = strlen16( cv->trace );
+	char *str_offset, *str_end;
+	FOLD *fold;
+	int k;
+
+	boundary = (int *) calloc( strlen( cv_segments ) + 3, sizeof( int ) );	// (more than enough)
+	if (boundary == NULL)	{
+		printf( "Had trouble allocating the cross-validation folds!\n" );
+		exit( -1 );
+	}
+	if (strchr( cv_segments, ',' ) == NULL)	{		// the number of segments: make them all the same size
+		num_segments = atoi( cv_segments );
+		if (num_segments < 2)
+			num_segments = 2;
+		boundary = (int *) realloc( boundary, (num_segments + 1) * sizeof( int ) );
+		if (boundary == NULL)	{
+			printf( "Had trouble allocating the cross-validation folds!\n" );
+			exit( -1 );
+		}
+		for (k = 0; k < num_segments; k++)
+			boundary[k] = (int) ((long) k * length / num_segments) & ~1;
+	}
+	else	{										// the offsets of the boundaries
+		num_segments = 1;
+		for (str_offset = cv_segments; *str_offset != '\0'; str_offset = str_end)	{
+			boundary[ num_segments++ ] = (int) strtol( str_offset, &str_end, 10 ) & ~1;
+			if (str_end == str_offset || (*str_end != ',' && *str_end != '\0'))	{
+				printf( "Had trouble reading the segment offsets (option -cv)\n" );
+				exit( -1 );
+			}
+			if (*str_end == ',')
+				str_end++;
+		}
+	}
+	boundary[ num_segments ] = length;
+	for (k = 0; k < num_segments; k++)
+		if (boundary[k] >= boundary[k+1])	{
+			printf( "Segment %d (option -cv) is empty: the training file has %d symbols!\n", k+1, length );
+			exit( -1 );
+		}
+
+	cv->num_folds = num_segments - 1;
+	cv->folds = (FOLD *) calloc( cv->num_folds, sizeof( FOLD ) );
+	if (cv->folds == NULL)	{
+		printf( "Had trouble allocating the cross-validation folds!\n" );
+		exit( -1 );
+	}
+	for (k = 0; k < cv->num_folds; k++)	{
+		fold = &cv->folds[k];
+		fold->train_start = (cv_window > 0 && k+1 > cv_window) ? boundary[ k+1 - cv_window ] : 0;
+		fold->test_start = boundary[ k+1 ];
+		fold->test_end = boundary[ k+2 ];
+	}
+	free( boundary );
+}
+
+/*
+ * cross_validate
+ * Run the -cv folds on the training file, which is read in (or mapped)
+ * just once.  The folds that are trained from the start of the file
+ * are nested, so they're trained here, in one pass over it: the given
+ * model is trained up to each fold's test segment in turn, and the fold
+ * takes its frozen copy (see take_frozen_model()) before it carries on.
+ * (A fold with a -cv_window trains its own model.)  Then the folds are
+ * tested on a pool of threads (see pool.h), and each fold's results are
+ * printed as soon as it and every fold before it are done, in order.
+ */
+void cross_validate( MODEL *model )
+{
+	CROSS_VALIDATION cv;
+	POOL pool;
+	FOLD *fold;
+	int trained = 0;		// the model has been trained on the symbols before this
+	int done = FALSE;		// true once a DONE symbol has ended the training
+	int started;
+	int k, w;
+
+	cv.trace = fread16_all( training_file );
+	if (cv.trace == NULL)	{
+		printf( "Had trouble reading the training file!\n" );
+		exit( -1 );
+	}
+	read_folds( &cv );
+	printf( "   <MaxOrder>%d</MaxOrder>\n", model->max_order );
+	printf( "   <NumFolds>%d</NumFolds>\n", cv.num_folds );
+
+	// The pairs are flipped as they're read for WHEN (see train_model()), since the
+	// segments are tested straight from the trace too.
+	for (k = 0; k < cv.num_folds; k++)	{
+		fold = &cv.folds[k];
+		initialize_model( &fold->model, model->max_order );
+		if (fold->train_start != 0)
+			continue;
+		if (!done)	{
+			done = (train_on_symbols( model, cv.trace->s + trained, fold->test_start - trained,
+					(research_question == WHEN) ) < fold->test_start - trained);
+			clear_current_order( model );
+			trained = fold->test_start;
+		}
+		freeze_model( model );
+		take_frozen_model( &fold->model, model );
+	}
+
+	if (num_threads <= 0)
+		num_threads = (int) sysconf( _SC_NPROCESSORS_ONLN );
+	if (num_threads <= 0)
+		num_threads = 1;
+	cv.scratches = (MODEL_SCRATCH *) calloc( num_threads, sizeof( MODEL_SCRATCH ) );
+	if (cv.scratches == NULL)	{
+		printf( "Had trouble allocating the cross-validation folds!\n" );
+		exit( -1 );
+	}
+	for (w = 0; w < num_threads; w++)
+		initialize_scratch( &cv.scratches[w] );
+
+	started = pool_start( &pool, num_threads, cv.num_folds, NULL, run_fold, &cv );
+	for (k = 0; k < cv.num_folds; k++)	{
+		if (started)
+			pool_wait_for( &pool, k );
+		else
+			run_fold( &cv, 0, k );
+		fold = &cv.folds[k];
+		fwrite( fold->job.out_text, 1, fold->job.out_bytes, stdout );
+#ifdef COUNT_NUMBER_OF_PREDICTIONS_RETURNED
+		if (num_pred_file != NULL)
+			fwrite( fold->job.num_pred_text, 1, fold->job.num_pred_bytes, num_pred_file );
+#endif
+		free( fold->job.out_text );
+		free( fold->job.num_pred_text );
+	}
+	if (started)
+		pool_finish( &pool );
+
+	for (w = 0; w < num_threads; w++)
+		free_scratch( &cv.scratches[w] );
+	free( cv.scratches );
+	free( cv.folds );
+	delete_string16( cv.trace );		// (this unmaps it if it was mapped)
+}
+
+/*
+ * run_fold
+ * Test one fold on the given worker (training its model first, if
+ * cross_validate() didn't), writing a <Fold> element with its -p
+ * results and its log-loss into memory until cross_validate() prints
+ * them.  The test segment is read straight out of the trace.  (This is
+ * the pool's POOL_JOB_FUNCTION.)
+ */
+void run_fold( void *context, int worker, int fold_number )
+{
+	CROSS_VALIDATION *cv = (CROSS_VALIDATION *) context;
+	FOLD *fold = &cv->folds[ fold_number ];
+	JOB *job = &fold->job;
+	MODEL_SCRATCH *scratch = &cv->scratches[ worker ];
+
+	job->function = PREDICT_TEST;
+	sprintf( job->test_file_name, "fold %d", fold_number+1 );
+	job->max_order = fold->model.max_order;
+	job->confidence_level = confidence_level;
+	job->out = open_memstream( &job->out_text, &job->out_bytes );
+	job->num_pred_file = open_memstream( &job->num_pred_text, &job->num_pred_bytes );
+	job->test_file = fmemopen( cv->trace->s + fold->test_start,
+			(fold->test_end - fold->test_start) * sizeof( SYMBOL_TYPE ), "rb" );
+	if (job->out == NULL || job->num_pred_file == NULL || job->test_file == NULL)	{
+		printf( "Had trouble allocating the cross-validation folds!\n" );
+		exit( -1 );
+	}
+	fprintf( job->out, "   <Fold>\n" );
+	fprintf( job->out, "   <FoldNumber>%d</FoldNumber>\n", fold_number+1 );
+	fprintf( job->out, "   <TrainStart>%d</TrainStart>\n", fold->train_start );
+	fprintf( job->out, "   <TestStart>%d</TestStart>\n", fold->test_start );
+	fprintf( job->out, "   <TestEnd>%d</TestEnd>\n", fold->test_end );
+
+	if (fold->train_start != 0)	{
+		set_memory_budget( &fold->model, memory_budget_kb * 1024L );
+		train_on_symbols( &fold->model, cv->trace->s + fold->train_start,
+				fold->test_start - fold->train_start, (research_question == WHEN) );
+		clear_current_order( &fold->model );
+		shrink_model( &fold->model );
+		freeze_model( &fold->model );
+	}
+	predict_test( &fold->model, scratch, job, 1 );
+	rewind( job->test_file );
+	fprintf( job->out, "   <LogLoss>%f</LogLoss>\n", compute_logloss( &fold->model, scratch, job->test_file, FALSE ) );
+	fprintf( job->out, "   </Fold>\n" );
+
+	fclose( job->test_file );
+	fclose( job->out );
+	fclose( job->num_pred_file );
+	free_model( &fold->model );
+}
+
 /*
  * This routine checks for command line options, and opens the
  * input and output files.  The only other command line option
@@ -309,6 +839,7 @@ int initialize_options( int argc, char **argv )
     int function = NO_FUNCTION;
     char str_type[41];
     char str_dir[41], *str_file = str_dir;
+    char *str_order;	// the next of the -o orders
     int temp;
 
     	/* Set Defaults */
@@ -316,6 +847,7 @@ int initialize_options( int argc, char **argv )
     str_delimiters[0] = '\0';		// clear delimeter string
 #endif
     str_type[0] = '\0';				// clear string_type
+    training_file_name[0] = '\0';
     representation = NONE;
     research_question = WHERE;		// 'Where will Bob be at 10:00?' type questions.
 
@@ -353,12 +885,26 @@ int initialize_options( int argc, char **argv )
         else if ( strcmp( *argv, "-o" ) == 0 )
         	{
         	argc--;
-            max_order = atoi( *++argv );
-            // IN this version of the code, where we put time in context and
-            // ask the model to predict loc (assuming time,loc pairs), the max_order
-            // needs to be an odd number.
-            if (max_order%2 == 0)
-            	printf("max_order should be an odd value!\n");
+        	// The order, or a comma separated list of them for a sweep.  The model
+        	// is trained with the highest.
+        	str_order = *++argv;
+        	for (num_sweep_orders = 0; str_order != NULL; num_sweep_orders++)	{
+        		if (num_sweep_orders == MAX_SWEEP_ORDERS)	{
+        			printf( "Too many orders (option -o)\n" );
+        			exit( -1 );
+        			}
+        		sweep_orders[ num_sweep_orders ] = atoi( str_order );
+        		if (num_sweep_orders == 0 || sweep_orders[ num_sweep_orders ] > max_order)
+        			max_order = sweep_orders[ num_sweep_orders ];
+        		// IN this version of the code, where we put time in context and
+        		// ask the model to predict loc (assuming time,loc pairs), the max_order
+        		// needs to be an odd number.
+        		if (sweep_orders[ num_sweep_orders ]%2 == 0)
+        			printf("max_order should be an odd value!\n");
+        		str_order = strchr( str_order, ',' );
+        		if (str_order != NULL)
+        			str_order++;
+        		}
         	}
         // -v
         else if ( strcmp( *argv, "-v" ) == 0 )
@@ -384,7 +930,9 @@ int initialize_options( int argc, char **argv )
          else if ( strcmp( *argv, "-c" ) == 0 ) 	{
         	argc--;
             temp = atoi( *++argv );
-            if (temp > 100) {
+            if (strcmp( *argv, "all" ) == 0)
+            	temp = ALL_CONFIDENCE_LEVELS;
+            else if (temp > 100) {
             	fprintf(stderr, "Confidence level %d is out of range.  Should be between 0 and 100 (inclusive) or -1\n", temp);
             	fprintf(stderr, "Ignoring the confidence level argument.\n");
             	temp = -1;
@@ -430,21 +978,92 @@ int initialize_options( int argc, char **argv )
         else if ( strcmp( *argv, "-when" ) == 0 )    	{
             research_question = WHEN;
         	}
+        // -save_model <filename>
+        else if ( strcmp( *argv, "-save_model" ) == 0 )    	{
+        	argc--;
+        	strcpy( save_model_file_name, *++argv );
+        	}
+        // -load_model <filename>
+        else if ( strcmp( *argv, "-load_model" ) == 0 )    	{
+        	argc--;
+        	strcpy( load_model_file_name, *++argv );
+        	if (verbose)
+        		printf("Loading the model from file %s\n", load_model_file_name);
+        	}
+        // -batch <filename>
+        else if ( strcmp( *argv, "-batch" ) == 0 )    	{
+        	argc--;
+        	batch_file = fopen( *++argv, "r");
+    	    if ( batch_file == NULL )
+    	    	{
+    	        printf( "Had trouble opening the batch file (option -batch)\n" );
+    	        exit( -1 );
+    	    	}
+    	    function = BATCH_RUN;
+        	}
+        // -cv <number of segments> or -cv <offset,offset,...>
+        else if ( strcmp( *argv, "-cv" ) == 0 )    	{
+        	argc--;
+        	cv_segments = *++argv;
+        	function = CROSS_VALIDATE;
+        	}
+        // -cv_window <number of segments>
+        else if ( strcmp( *argv, "-cv_window" ) == 0 )    	{
+        	argc--;
+        	cv_window = atoi( *++argv );
+        	}
+        // -threads <number of threads>
+        else if ( strcmp( *argv, "-threads" ) == 0 )    	{
+        	argc--;
+        	num_threads = atoi( *++argv );
+        	}
+        // -memory_budget <kilobytes>
+        else if ( strcmp( *argv, "-memory_budget" ) == 0 )    	{
+        	argc--;
+        	memory_budget_kb = atol( *++argv );
+        	if (verbose)
+        		printf("Memory budget is %s kilobytes\n", *argv);
+        	}
         else
         	{
             fprintf( stderr, "\nUsage: predict [-o order] [-v] [-logloss predictfile] " );
-            fprintf( stderr, "[-f text file] [-p predictfile] [-input_type string_type] [-when]\n" );
+            fprintf( stderr, "[-f text file] [-p predictfile] [-input_type string_type] [-when]" );
+            fprintf( stderr, " [-save_model modelfile] [-load_model modelfile] [-memory_budget kbytes]" );
+            fprintf( stderr, " [-batch batchfile] [-threads n] [-cv n|offset,...] [-cv_window n]\n" );
             fprintf( stdout, "\nUsage: predict [-o order] [-v] [-logloss predictfile] " );
-            fprintf( stdout, "[-f text file] [-p predictfile] [-input_type string_type] [-when]\n" );
+            fprintf( stdout, "[-f text file] [-p predictfile] [-input_type string_type] [-when]" );
+            fprintf( stdout, " [-save_model modelfile] [-load_model modelfile] [-memory_budget kbytes]" );
+            fprintf( stdout, " [-batch batchfile] [-threads n] [-cv n|offset,...] [-cv_window n]\n" );
              exit( -1 );
         	}
         argc--;
         argv++;
     	}
-    if (verbose)
-    	printf("Research question is %s\n", (research_question==WHERE)? "WHERE":"WHEN");
-    else
-    	printf("   <ResearchQuestion>%s</ResearchQuestion>\n",(research_question==WHERE)? "WHERE":"WHEN");
+    // A loaded model brings its own research question, so it's printed once the model is loaded.
+    if (load_model_file_name[0] == '\0')
+    	print_research_question();
+    if (function == BATCH_RUN)	{
+    	// Each job opens its own files, and prints its own results.
+    	if (verbose || load_model_file_name[0] != '\0' || save_model_file_name[0] != '\0')	{
+    		fprintf( stderr, "-batch can't be used with -v, -load_model or -save_model.\n" );
+    		exit( -1 );
+    		}
+    	setbuf( stdout, NULL );
+    	return( function );
+    	}
+    if (function == CROSS_VALIDATE &&
+    		(verbose || load_model_file_name[0] != '\0' || save_model_file_name[0] != '\0'))	{
+    	// Each fold trains its own model, and prints its own results.
+    	fprintf( stderr, "-cv can't be used with -v, -load_model or -save_model.\n" );
+    	exit( -1 );
+    	}
+    if (load_model_file_name[0] != '\0')	{
+    	// The model will be loaded, so there's no training file to open.
+    	if (!verbose)
+    		printf("   <ModelFile>%s</ModelFile>\n", load_model_file_name);
+    	setbuf( stdout, NULL );
+    	return( function );
+    	}
     training_file = fopen( training_file_name, "rb" );
     if (verbose)
     	fprintf(stdout,"%s\n", training_file_name);
@@ -461,70 +1080,189 @@ int initialize_options( int argc, char **argv )
     return( function );
    }
 
+/*
+ * num_pred_lines
+ * Which lines analyze_pred_results() writes to num_pred.csv for each
+ * test at the given confidence level: the numbers of most and less
+ * likely predictions (WHERE, or no confidence level), the number the
+ * confidence level used, or none at all (-c all).
+ */
+int num_pred_lines( int level )
+{
+	if (level == -1 || research_question == WHERE)
+		return( BEST_NUM_PRED_LINES );
+	else if (level == ALL_CONFIDENCE_LEVELS)
+		return( NO_NUM_PRED_LINES );
+	else
+		return( CONFIDENCE_NUM_PRED_LINES );
+}
+
+/*
+ * print_research_question
+ * Print the research question, as the <ResearchQuestion> element of
+ * the <Run> (or in words, for -v).
+ */
+void print_research_question( void )
+{
+    if (verbose)
+    	printf("Research question is %s\n", (research_question==WHERE)? "WHERE":"WHEN");
+    else
+    	printf("   <ResearchQuestion>%s</ResearchQuestion>\n",(research_question==WHERE)? "WHERE":"WHEN");
+}
+
 /*******************************************
  * predict_test
  *
  * Given a test string, test each character of the string.
- * For example, if the test string is "abc", call
- * predict_next() for each substring:
- * 		predict_next("", &pred);
- * 		predict_next("a", &pred);
- * 		predict_next("ab", & pred);
+ * For example, if the test string is "abc", predict the next
+ * symbol after each substring:
+ * 		"", "a", "ab"
+ * The context is carried along the string (see advance_context()),
+ * rather than being copied out and looked up all over again each time.
  *
  * This version (predict_MELT) has been modified to use the
  * first character in each pair as context and the second to predict.
  * (Of course, this assumes 1st order, and a representation of
  * <time,loc> pairs (aka binboxstrings).)
+ *
+ * The test file is mapped if it can be (see map_string16()), and tested
+ * in one piece.  Otherwise it's read TEST_CHUNK_LENGTH symbols at a time
+ * (an even number, so the WHEN flip never splits a pair), and the context
+ * just carries on from one piece to the next, so a test file can be any length.
+ * Each job is tested with its own max_order (none more than the model's),
+ * as if the model had been trained with that order (see
+ * predict_view_at_order()), so an -o sweep of several orders is tested
+ * in this one pass.  Each job has its own counters, and its own stream
+ * of number-of-predictions lines for the results writer (see writer.h).
  * INPUTS:
- * 	  test_string = pointer to string to test.
+ * 	  model = the model to test, scratch = scratch for its queries
+ * 	  jobs = the num_jobs jobs: the max_order, the confidence level, and
+ * 	  where to write the results of each.  The test file (opened for
+ * 	  reading) is the first job's.
  *
  * RETURNS: nothing
  * *********************************************/
-void predict_test( STRING16 * test_string){
-	int i;			// index into test string
-	int length;		// string length
-	SYMBOL_TYPE predicted_char;
-    STRING16 *str_sub;		// sub-strings (chunks of context)
+void predict_test( MODEL *model, MODEL_SCRATCH *scratch, JOB *jobs, int num_jobs){
+	int i;			// index into test file
+	int j;			// index into the piece of it in test_string
+	int length;		// number of symbols in test_string
+	int flip;		// 1 if the pairs in test_string are to be flipped as they are read
+	int max_order;	// the order of the job being tested
+	int o;			// index into jobs
+	JOB *job;		// ... and the job
+	SYMBOL_TYPE symbol;				// the symbol at i
+	SYMBOL_TYPE previous_symbol = 0;	// the symbol before it
+    STRING16 * test_string;			// the piece of the test file being tested
+    PREDICTION_VIEW pred;			// the predictions (a view into the model)
+    TEST_RESULTS results[ MAX_SWEEP_ORDERS ];	// counters for the results of each job's predictions
 	
-    //printf("Original test string %s\n", format_string16(test_string));
     // initialize
-    str_sub = string16(max_order);			// allocate memory for sub-string
-    length = strlen16( test_string);
-    build_test_string( test_string );		// if WHEN, flip string
-    
+    memset( results, 0, sizeof( results ) );
+    for (o=0; o < num_jobs; o++)
+    	results_stream_open( &jobs[o].num_preds, &results_writer, jobs[o].num_pred_file, jobs[o].test_file_name );
+    test_string = map_string16( jobs[0].test_file );
+    if (test_string != NULL)
+    	length = strlen16( test_string);
+    else	{
+    	test_string = string16(TEST_CHUNK_LENGTH+1);
+    	length = fread16( test_string, TEST_CHUNK_LENGTH, jobs[0].test_file);
+    }
+    reset_context( model, scratch );
+
     /***********
      * LOOP
      ***********/
-    // Go through test string, and try to predict every other symbol
-    // using the context of the preceding symbol.
-    // note that the loop starts with 1 because we are using char 0 for context only,
-    // not prediction.  (This loop works for higher orders.)
-  
-    for (i=max_order; i < length; i+= 2, NumTests++)	{	
-		// Copy the symbols preceding the test-symbol into str_sub.
-		if (i < max_order)
-			strncpy16( str_sub, test_string,0, i);	// create test string
-		else
-			strncpy16( str_sub, test_string, i-max_order, max_order);
-
-		/****************************************
-		 * DO THE PREDICTION
-		 ***************************************/
-		predicted_char = predict_next(str_sub, &pred);
-		//printf("%s!\n\n", predicted_char == get_symbol( test_string, i) ?  "RIGHT" : "WRONG");
-		
-		/****************************************
-		 * Analyze the results
-		 ****************************************/
-		analyze_pred_results( get_symbol(test_string,i), get_symbol(test_string,i-1));
+    // Go through the test file, and try to predict every other symbol
+    // using the context of the preceding symbols.  The first max_order
+    // symbols are used for context only, not prediction.
+    // (This loop works for higher orders.)
+    for (i = 0; length > 0; length = fread16( test_string, TEST_CHUNK_LENGTH, jobs[0].test_file))	{
+		flip = build_test_string( test_string );		// if WHEN, flip string
+		for (j=0; j < length; i++, j++)	{
+			symbol = get_flipped_symbol(test_string, j, flip);
+			for (o=0; o < num_jobs; o++)	{
+				job = &jobs[o];
+				max_order = job->max_order;
+				if (i < max_order || (i - max_order) % 2 != 0)
+					continue;
+				/****************************************
+				 * DO THE PREDICTION
+				 ***************************************/
+				// With a confidence level, only the predictions that add up to it
+				// are looked at, unless the model falls back to order 0 (all of the
+				// fallback predictions are checked) or they are all to be printed.
+				if (job->confidence_level >= 0 && research_question == WHEN && !verbose)	{
+					predict_view_at_order( model, scratch, max_order, MAX_NUM_PREDICTIONS, (float) job->confidence_level/100.0, &pred);
+					if (pred.depth == 0)
+						predict_view_at_order( model, scratch, max_order, MAX_NUM_PREDICTIONS, ALL_OF_THE_MASS, &pred);
+				}
+				else
+					predict_view_at_order( model, scratch, max_order, MAX_NUM_PREDICTIONS, ALL_OF_THE_MASS, &pred);
+
+				/****************************************
+				 * Analyze the results
+				 ****************************************/
+				analyze_pred_results( job, &results[o], &pred, symbol, previous_symbol);
+				results[o].NumTests++;
+			}
+
+			// Move the context along to the next symbol.
+			advance_context( model, scratch, symbol );
+			previous_symbol = symbol;
+		}
     }
     /***********************************************
      * Output the results
      ***********************************************/
-    output_pred_results();
+    for (o=0; o < num_jobs; o++)	{
+    	results_stream_close( &jobs[o].num_preds );		// (so the lines are all written when it returns)
+    	output_pred_results( &jobs[o], &results[o] );
+    }
+    delete_string16( test_string);		// (this unmaps it if it was mapped)
 	return;
 }	// end of predict_test
 
+/*******************************************
+ * predict_test_sweep
+ *
+ * predict_test() for the orders of an -o sweep, one job for each.
+ * Each job's results (and number of predictions) are written into
+ * memory as the test goes along, and then printed one job after the
+ * other, each in an <Order> element, so they aren't mixed together.
+ * *********************************************/
+void predict_test_sweep( MODEL *model, MODEL_SCRATCH *scratch, JOB *jobs, int num_jobs){
+	int o;
+
+	for (o=0; o < num_jobs; o++)	{
+		jobs[o].out = open_memstream( &jobs[o].out_text, &jobs[o].out_bytes );
+		jobs[o].num_pred_file = open_memstream( &jobs[o].num_pred_text, &jobs[o].num_pred_bytes );
+		if (jobs[o].out == NULL || jobs[o].num_pred_file == NULL)	{
+			printf( "Had trouble allocating the order sweep!\n" );
+			exit( -1 );
+		}
+	}
+	predict_test( model, scratch, jobs, num_jobs );
+	for (o=0; o < num_jobs; o++)	{
+		fclose( jobs[o].out );
+		fclose( jobs[o].num_pred_file );
+		if (verbose)
+			printf( "Order %d:\n", jobs[o].max_order );
+		else	{
+			printf( "   <Order>\n" );
+			printf( "   <MaxOrder>%d</MaxOrder>\n", jobs[o].max_order );
+		}
+		fwrite( jobs[o].out_text, 1, jobs[o].out_bytes, stdout );
+		if (!verbose)
+			printf( "   </Order>\n" );
+#ifdef COUNT_NUMBER_OF_PREDICTIONS_RETURNED
+		if (num_pred_file != NULL)
+			fwrite( jobs[o].num_pred_text, 1, jobs[o].num_pred_bytes, num_pred_file );
+#endif
+		free( jobs[o].out_text );
+		free( jobs[o].num_pred_text );
+	}
+}	// end of predict_test_sweep
+
 
 /********************************************************************
  * get_char_type
@@ -683,7 +1421,7 @@ int main( int argc, char **argv )
 	FILE * test_file;
 	SYMBOL_TYPE c;
 
-	str16 = string16(MAX_STRING_LENGTH);		// allocate new struct
+	str16 = string16(TEST_CHUNK_LENGTH);		// allocate new struct
 	// Fill the string
 /*	for (i = 0; i < 5; i++)
 		str16->s[i] = (SYMBOL_TYPE) i + 0x1000;
@@ -703,7 +1441,7 @@ int main( int argc, char **argv )
 */
 	test_file = fopen( "108wks01_05.dat", "rb");
 	/* This is one way to read in a file:  */
-	i = fread16( str16, MAX_STRING_LENGTH, test_file);
+	i = fread16( str16, TEST_CHUNK_LENGTH, test_file);
 	printf("The string is: %s\n", format_string16( str16));
 	fclose( test_file);
 	/**/
@@ -726,10 +1464,11 @@ int main( int argc, char **argv )
  *	neighboring_ap
  * 
  * Given two symbols for locations (AP) return true if
- * the first one is a neighbor of the second.
+ * the first one is a neighbor of the second.  (Errors
+ * are written to out, with the rest of the results.)
  * 
  ***********************************************************/
-unsigned char neighboring_ap( SYMBOL_TYPE predicted_ap, SYMBOL_TYPE actual_ap)
+unsigned char neighboring_ap( SYMBOL_TYPE predicted_ap, SYMBOL_TYPE actual_ap, FILE *out)
 {
 	unsigned int i;
 	unsigned int actual_ap_number=0;
@@ -742,7 +1481,7 @@ unsigned char neighboring_ap( SYMBOL_TYPE predicted_ap, SYMBOL_TYPE actual_ap)
 			break;
 		}
 	if (i == 525)  {
-		printf("Error: hit end of ap_map looking for 0x%x\n", actual_ap);
+		fprintf(out, "Error: hit end of ap_map looking for 0x%x\n", actual_ap);
 		return( FALSE );
 	}
 	
@@ -824,46 +1563,40 @@ char * get_str_mappings(int mapping)
 *
 *	build_test_string
 *
-* Build test string for testing.  If predicting WHERE, leave it alone.
-* If predicting WHEN, flip it to go LTLTLTL instead of TLTLTLTLTL
+* Build test string for testing.  If predicting WHEN, flip it to go LTLTLTL instead of TLTLTLTLTL
 * where L=location and T=time
+* A mapped test string can't be changed, so it is flipped as it is read
+* instead: see get_flipped_symbol().
 *
 * INPUTS: test_string = input test string
-* OUTPUTS: If WHEN, test_string has been flipped.
-* RETURNS: nothing
+* OUTPUTS: If WHEN (and test_string isn't mapped), test_string has been flipped.
+* RETURNS: 1 if the caller has to flip the test string as it reads it, else 0
 *************************************************************************/
-void build_test_string(STRING16 * test_string)
+int build_test_string(STRING16 * test_string)
 {
-	STRING16 * str_dest;
-	int length;
-	int i;
-	
-	length = strlen16(test_string);
+	int flip = 0;
+
    	if (research_question == WHEN)	{
-        str_dest = string16( length);			// allocate memory for actual test string
-    	for (i=0; i < length; i++)
-    		if (i%2) {	// odd
-    			//Do this (16bit version):str_dest[i-1] = test_string[i];
-    			put_symbol(str_dest, i-1, get_symbol(test_string,i));
-    		}
-    		else	{	// even
-    			//Do this (16bit version): str_dest[i+1] = test_string[i];
-    			put_symbol(str_dest, i+1, get_symbol(test_string,i));
-    		}
-    	set_strlen16(str_dest, i);			// terminate the string
-    	strncpy16( test_string, str_dest, 0, length);	// copy into final location
-    }
+   		if (test_string->mapping_bytes != 0)
+   			flip = 1;
+   		else
+   			swap_pairs16( test_string->s, strlen16(test_string));	// swap each pair in place
+   	}
     if (verbose) {
-    	printf("Testing on string %s\n", format_string16(test_string));
+    	printf("Testing on string ");
+    	print_string16(stdout, test_string, flip);
+    	printf("\n");
     }
+    return (flip);
 }	// end of build_test_string()
 /********************************************************
  * 
  * analyze_results
  * Look at results and add to counters
- * INPUT: correct_answer is the actual result from the test string
+ * INPUT: results = the counters to add to, pred = the predictions
+ * correct_answer is the actual result from the test string
  * All other inputs come from global variables.
- * OUTPUTS: Global counters are incremented.
+ * OUTPUTS: The counters in results are incremented.
  * RETURNS: void
  * 
  * The pred structure returns ALL predictions (unless the
@@ -874,10 +1607,10 @@ void build_test_string(STRING16 * test_string)
  * the most likely to the least likely.  I want to first look
  * at only the most likely results and count their stats and
  * then look at the other, less likely results.
- * GLOBAL: num_pred_file is file to output the number of predictions returned for each test.
- * 	confidence_level is used to determine which predictions to use (WHEN case only)
+ * The job's num_preds stream gets the number of predictions returned for each test (for its num_pred_file),
+ * 	and its confidence_level is used to determine which predictions to use (WHEN case only)
  ********************************************************/
-void analyze_pred_results( SYMBOL_TYPE correct_answer, SYMBOL_TYPE context)
+void analyze_pred_results( JOB *job, TEST_RESULTS *results, PREDICTION_VIEW *pred, SYMBOL_TYPE correct_answer, SYMBOL_TYPE context)
 {		
 	int j;				// counter into number of predictions
 	unsigned char predicted_correctly;	// true if one of the predictions is correct
@@ -900,57 +1633,57 @@ void analyze_pred_results( SYMBOL_TYPE correct_answer, SYMBOL_TYPE context)
 	unsigned char bool_done = FALSE;		// true to break out of confidence_level loop.	
 	
 	if (verbose) {		// Print output
-       	printf("context,expected symbol, predicted symbol, # predictions, order, probability\n");
+       	fprintf(job->out, "context,expected symbol, predicted symbol, # predictions, order, probability\n");
 
-		for (j=0; j < pred.num_predictions; j++)  {	
+		for (j=0; j < pred->num_predictions; j++)  {	
 			if (research_question == WHERE) {
 				get_hhmm_from_code(context, str_time );
-				printf("%s, 0x%04x, 0x%04x, %d, %d, %f, %s\n",
+				fprintf(job->out, "%s, 0x%04x, 0x%04x, %d, %d, %f, %s\n",
 					str_time,						// context time.
 					correct_answer,					// expected symbol
-					pred.sym[j].symbol,				// predicted symbol
-					pred.num_predictions,
-					pred.depth,						// depth
-					(float) pred.sym[j].prob_numerator/pred.prob_denominator,
-					(correct_answer == pred.sym[j].symbol)? "CORRECT" : "--");
+					VIEW_SYMBOL( pred, j),				// predicted symbol
+					pred->num_predictions,
+					pred->depth,						// depth
+					(float) VIEW_COUNT( pred, j)/pred->prob_denominator,
+					(correct_answer == VIEW_SYMBOL( pred, j))? "CORRECT" : "--");
 			}
 			else //research_question == WHEN
 				{
 				// If the prediction is from falling back to 0, don't bother with it
 				// if it's returning a location instead of a time.  (Remember, the model doesn't
 				// know there's a diff)
-				if ((pred.depth==0)) 
-					if (get_char_type( pred.sym[j].symbol, 0) == LOC)
+				if ((pred->depth==0)) 
+					if (get_char_type( VIEW_SYMBOL( pred, j), 0) == LOC)
 							continue;						// this is a LOC, go onto the next TIME prediction.
 				get_hhmm_from_code(correct_answer, str_time );	// convert expected symbol to time
-				get_hhmm_from_code(pred.sym[j].symbol, str_time2);			// convert prediction into a time
-				printf("0x%04x, %s, %s, %d, %d, %f, %s\n",
+				get_hhmm_from_code(VIEW_SYMBOL( pred, j), str_time2);			// convert prediction into a time
+				fprintf(job->out, "0x%04x, %s, %s, %d, %d, %f, %s\n",
 					context,		// location
 					str_time,		// expected symbol
 					str_time2,		// predicted symbol
-					pred.num_predictions,
-					pred.depth,						// depth
-					(float) pred.sym[j].prob_numerator/pred.prob_denominator,
-					(correct_answer == pred.sym[j].symbol)? "CORRECT" : "--");
+					pred->num_predictions,
+					pred->depth,						// depth
+					(float) VIEW_COUNT( pred, j)/pred->prob_denominator,
+					(correct_answer == VIEW_SYMBOL( pred, j))? "CORRECT" : "--");
 				}
 			}
 		} // end if verbose
 	/*****
 	 * Check if any predictions were returned.
 	 ******/
-	if (pred.num_predictions == 0)	// no predictions were returned!
+	if (pred->num_predictions == 0)	// no predictions were returned!
 		return;
 	
 	/******
 	 * Check for fallback to 0 order.
 	 *******/
 	// Check for the fallback situation, where the model fell back to order 0
-	if (pred.depth == 0)	{	//Model fell back to 0th-order
-		FallbackNum++;
+	if (pred->depth == 0)	{	//Model fell back to 0th-order
+		results->FallbackNum++;
 		//  See if one of the fallback predictions is correct.
-		for (j=1; j < pred.num_predictions; j++)
-			if (correct_answer == pred.sym[j].symbol)	{
-				FallbackNumCorrect++;
+		for (j=1; j < pred->num_predictions; j++)
+			if (correct_answer == VIEW_SYMBOL( pred, j))	{
+				results->FallbackNumCorrect++;
 				break;
 			}
 		return;	// Don't need to check any farther.
@@ -962,14 +1695,14 @@ void analyze_pred_results( SYMBOL_TYPE correct_answer, SYMBOL_TYPE context)
 	// The first element in the pred structure is the most likely.
 	// It's count value is the numerator of it's probability, so
 	// any entries with the same count have the same probability.
-	best_count = pred.sym[0].prob_numerator;	// highest count (probability)
+	best_count = VIEW_COUNT( pred, 0);	// highest count (probability)
 	index_last_best = 0;						// assume only one prediction.
 	num_best_predictions = 1;
 	
 	// Do a quick check to see if more than one prediction was returned
 	// as the most likely.
-	for (j=1; j < pred.num_predictions; j++) {
-		if (pred.sym[j].prob_numerator == best_count) {
+	for (j=1; j < pred->num_predictions; j++) {
+		if (VIEW_COUNT( pred, j) == best_count) {
 			bool_MultipleBest = TRUE;
 			index_last_best = j;
 			num_best_predictions++;
@@ -982,11 +1715,11 @@ void analyze_pred_results( SYMBOL_TYPE correct_answer, SYMBOL_TYPE context)
 			num_less_predictions++;
 	}
 	if (bool_MultipleBest)
-		MostProb_MultiplePredictions++;
+		results->MostProb_MultiplePredictions++;
 	if (bool_MultipleLess)
-		LessProb_MultiplePredictions++;
+		results->LessProb_MultiplePredictions++;
 	
-	if (confidence_level == -1 || research_question == WHERE) {
+	if (job->confidence_level == -1 || research_question == WHERE) {
 #ifdef COUNT_NUMBER_OF_PREDICTIONS_RETURNED
 		/*****
 		 * Output the number of predictions to a file.
@@ -995,7 +1728,7 @@ void analyze_pred_results( SYMBOL_TYPE correct_answer, SYMBOL_TYPE context)
 		//fprintf(num_pred_file,"     <NumBestPred>%d</NumBestPred>\n", num_best_predictions);
 		//fprintf(num_pred_file,"     <NumLessPred>%d</NumLessPred>\n", num_less_predictions);
 		//fprintf(num_pred_file,"  </Test>\n");
-		fprintf(num_pred_file,"%s, %d, %d, %d\n", test_file_name, num_best_predictions, num_less_predictions,pred.num_predictions);
+		results_append( &job->num_preds, num_best_predictions, num_less_predictions, pred->num_predictions);
 #endif
 		/*************
 		 * Check predictions for correctness or if they are close to correct.
@@ -1003,9 +1736,9 @@ void analyze_pred_results( SYMBOL_TYPE correct_answer, SYMBOL_TYPE context)
 		// Check the most likely predictions first.
 		predicted_correctly = FALSE;		// Assume they are all wrong.
 		for (j=0; (j < index_last_best+1) && (!predicted_correctly); j++)  {
-			if (correct_answer == pred.sym[j].symbol) {
+			if (correct_answer == VIEW_SYMBOL( pred, j)) {
 				predicted_correctly = TRUE;
-				MostProb_NumCorrect++;
+				results->MostProb_NumCorrect++;
 			}
 		}
 		if (!predicted_correctly)  {
@@ -1016,34 +1749,34 @@ void analyze_pred_results( SYMBOL_TYPE correct_answer, SYMBOL_TYPE context)
 			for (j=0; j < index_last_best; j++)  {
 				// this prediction is wrong.  See if it is close.
 				if (research_question == WHERE) {
-					is_neighbor = neighboring_ap( pred.sym[j].symbol, correct_answer);
+					is_neighbor = neighboring_ap( VIEW_SYMBOL( pred, j), correct_answer, job->out);
 					if (is_neighbor)
 						break;
 				}
 				else {  //research_question is WHEN
-					is_within_10min = within_time_window( pred.sym[j].symbol, correct_answer, 10);
+					is_within_10min = within_time_window( VIEW_SYMBOL( pred, j), correct_answer, 10, job->out);
 					if (!is_within_20min)
 						// stop checking to see if one is within 20 minutes if you already found one.
-						is_within_20min = within_time_window( pred.sym[j].symbol, correct_answer, 20);
+						is_within_20min = within_time_window( VIEW_SYMBOL( pred, j), correct_answer, 20, job->out);
 					if (is_within_10min)
 						break;
 				}
 			}
 			// Update the counters for the MostProbable predictions
 			if (is_neighbor)
-				MostProb_NeighborCorrect++;
+				results->MostProb_NeighborCorrect++;
 			if (is_within_10min)
-				MostProb_Within10Minutes++;
+				results->MostProb_Within10Minutes++;
 			if (is_within_20min)
-				MostProb_Within20Minutes++;
+				results->MostProb_Within20Minutes++;
 		}
 			
 		//Now check less likely predictions
 		predicted_correctly = FALSE;	// assume they are all wrong.
-		for (j=index_last_best+1; (j < pred.num_predictions) && !predicted_correctly; j++)  {
-			if (correct_answer == pred.sym[j].symbol) {
+		for (j=index_last_best+1; (j < pred->num_predictions) && !predicted_correctly; j++)  {
+			if (correct_answer == VIEW_SYMBOL( pred, j)) {
 				predicted_correctly = TRUE;
-				LessProb_NumCorrect++;
+				results->LessProb_NumCorrect++;
 			}
 		}
 		if (!predicted_correctly) {	
@@ -1051,35 +1784,37 @@ void analyze_pred_results( SYMBOL_TYPE correct_answer, SYMBOL_TYPE context)
 			is_neighbor = FALSE;
 			is_within_10min = FALSE;
 			is_within_20min = FALSE;
-			for (j=index_last_best+1; j < pred.num_predictions; j++)  {
+			for (j=index_last_best+1; j < pred->num_predictions; j++)  {
 				// this prediction is wrong.  See if it is close.
 				if (research_question == WHERE) {
-					is_neighbor = neighboring_ap( pred.sym[j].symbol, correct_answer);
+					is_neighbor = neighboring_ap( VIEW_SYMBOL( pred, j), correct_answer, job->out);
 					if (is_neighbor)
 						break;
 				}
 				else {  //research_question is WHEN
-					is_within_10min = within_time_window( pred.sym[j].symbol, correct_answer, 10);
+					is_within_10min = within_time_window( VIEW_SYMBOL( pred, j), correct_answer, 10, job->out);
 					if (!is_within_20min)
 						// stop checking to see if one is within 20 minutes if you already found one.
-						is_within_20min = within_time_window( pred.sym[j].symbol, correct_answer, 20);
+						is_within_20min = within_time_window( VIEW_SYMBOL( pred, j), correct_answer, 20, job->out);
 					if (is_within_10min)
 						break;
 				}
 			}
 		// Update the counters for the LessProbable predictions
 		if (is_neighbor)
-			LessProb_NeighborCorrect++;
+			results->LessProb_NeighborCorrect++;
 		if (is_within_10min)
-			LessProb_Within10Minutes++;
+			results->LessProb_Within10Minutes++;
 		if (is_within_20min)
-			LessProb_Within20Minutes++;
+			results->LessProb_Within20Minutes++;
 		}
 	}		// end of checking predictions without using confidence level
+	else if (job->confidence_level == ALL_CONFIDENCE_LEVELS)	// use every confidence level at once
+		analyze_confidence_levels( results, pred, correct_answer);
 	else	// use confidence level to determine which predictions to use.
 	{
 
-		f_confidence = (float) confidence_level/100.0;			// convert to a value between 0 and 1 (inclusive)
+		f_confidence = (float) job->confidence_level/100.0;			// convert to a value between 0 and 1 (inclusive)
 		assert (f_confidence >= 0 && f_confidence <= 1);	// check range
 		predicted_correctly = FALSE;				// Assume they are all wrong.
 		bool_done = FALSE;							// true if confidence-level has been reached.
@@ -1100,18 +1835,18 @@ void analyze_pred_results( SYMBOL_TYPE correct_answer, SYMBOL_TYPE context)
 		//printf("correct, prediction, prob, total_prob, confidence = %f\n", f_confidence);
 		// go through each prediction, stopping if we hit the confidence level or
 		// if we hit a correct prediction.
-		while ((j < pred.num_predictions) && (!bool_done)){
+		while ((j < pred->num_predictions) && (!bool_done)){
 			// calculate probability of this prediction
-			f_current_prob = (float) pred.sym[j].prob_numerator/ (float) pred.prob_denominator;
-			i_current_numerator = pred.sym[j].prob_numerator;
+			f_current_prob = (float) VIEW_COUNT( pred, j)/ (float) pred->prob_denominator;
+			i_current_numerator = VIEW_COUNT( pred, j);
 			// if its the same as the previous prediction or if we are below the
 			// confidence threshold, check to see if its correct.
 			if ((i_current_numerator == i_prev_numerator) || (f_prob_sum <= f_confidence))	{
 			//if ((f_current_prob == f_previous_prob) || (f_prob_sum <= f_confidence))	{
 				//printf(">>>");
-				if (correct_answer == pred.sym[j].symbol) {
+				if (correct_answer == VIEW_SYMBOL( pred, j)) {
 					predicted_correctly = TRUE;
-					MostProb_NumCorrect++;
+					results->MostProb_NumCorrect++;
 				}
 			}
 			//else
@@ -1124,7 +1859,7 @@ void analyze_pred_results( SYMBOL_TYPE correct_answer, SYMBOL_TYPE context)
 			}
 			f_previous_prob = f_current_prob;
 			i_prev_numerator = i_current_numerator;
-			//printf("0x%x, 0x%x, %f, %f, %f, %s\n", correct_answer, pred.sym[j].symbol, f_current_prob, f_prob_sum, f_confidence, (correct_answer == pred.sym[j].symbol)? "CORRECT" : "-----");
+			//printf("0x%x, 0x%x, %f, %f, %f, %s\n", correct_answer, VIEW_SYMBOL( pred, j), f_current_prob, f_prob_sum, f_confidence, (correct_answer == VIEW_SYMBOL( pred, j))? "CORRECT" : "-----");
 			j++;
 		}
 #ifdef COUNT_NUMBER_OF_PREDICTIONS_RETURNED
@@ -1134,70 +1869,136 @@ void analyze_pred_results( SYMBOL_TYPE correct_answer, SYMBOL_TYPE context)
 		//fprintf(num_pred_file,"  <Test value=\"%d\">\n", num_tested);
 		//fprintf(num_pred_file,"     <NumConfPred>%d</NumConfPred>\n", j-1);
 		//fprintf(num_pred_file,"  </Test>\n");
-		fprintf(num_pred_file,"%s, %d, %d, %d\n", test_file_name, confidence_level, j, pred.num_predictions);
+		results_append( &job->num_preds, job->confidence_level, j, pred->num_candidates);
 #endif
 
 	}	// end of confidence level tests.
 
 }	// end of analyze_results
+/********************************************************
+ * analyze_confidence_levels
+ * The confidence level tests of analyze_pred_results(), for every
+ * confidence level from 0 to 100 at once (-c all).
+ * INPUT: results = the counters to add to, pred = the predictions
+ * (all of them, not cut short at a confidence level),
+ * correct_answer is the actual result from the test string
+ * OUTPUTS: The counters in results->Level_xxx[] are incremented.
+ *
+ * The sum of the probabilities is the same at each prediction whatever
+ * the level, so one walk down the predictions does for all of them.
+ * A level's walk stops at the first prediction that takes the sum past
+ * the level (and isn't as likely as the one before), so the higher the
+ * level, the later it stops, and the levels still walking are always
+ * the ones from 'level' up.  The same float arithmetic is used as for a
+ * single level, so the counts are exactly the ones -c would give.
+ ********************************************************/
+void analyze_confidence_levels( TEST_RESULTS *results, PREDICTION_VIEW *pred, SYMBOL_TYPE correct_answer)
+{
+	int j;					// counter into number of predictions
+	int level = 0;			// the lowest level whose walk hasn't stopped
+	int correct_level = NUM_CONFIDENCE_LEVELS;	// the lowest level that checks the correct prediction
+	float f_prob_sum = 0.0;					// sum of prediction probabiliies
+	int i_current_numerator, i_prev_numerator = 0;  // numerator of current and previous probabilities
+	float f_confidence;						// a confidence_level expressed as a value between 0 and 1.
+
+	for (j=0; (j < pred->num_predictions) && (level < NUM_CONFIDENCE_LEVELS); j++)	{
+		i_current_numerator = VIEW_COUNT( pred, j);
+		if (correct_answer == VIEW_SYMBOL( pred, j))	{
+			// It's checked by the levels still walking if it's as likely as the one
+			// before, else by the ones the sum isn't past yet.
+			for (correct_level = level; correct_level < NUM_CONFIDENCE_LEVELS; correct_level++)	{
+				f_confidence = (float) correct_level/100.0;
+				if ((i_current_numerator == i_prev_numerator) || (f_prob_sum <= f_confidence))
+					break;
+			}
+		}
+		f_prob_sum += (float) VIEW_COUNT( pred, j)/ (float) pred->prob_denominator;
+		if (i_current_numerator != i_prev_numerator)	{
+			// the levels this prediction takes the sum past stop here, having used j+1 predictions
+			for ( ; level < NUM_CONFIDENCE_LEVELS; level++)	{
+				f_confidence = (float) level/100.0;
+				if (f_prob_sum <= f_confidence)
+					break;
+				results->Level_NumPredictions[ level ] += j+1;
+			}
+		}
+		i_prev_numerator = i_current_numerator;
+	}
+	for ( ; level < NUM_CONFIDENCE_LEVELS; level++)		// these used all of the predictions
+		results->Level_NumPredictions[ level ] += j;
+	for ( ; correct_level < NUM_CONFIDENCE_LEVELS; correct_level++)
+		results->Level_NumCorrect[ correct_level ]++;
+}	// end of analyze_confidence_levels
 /*************************************************
  * output_pred_results
  * if verbose, display the results in words
  * else in XML.
- * INPUTS: global counters
+ * INPUTS: job = where to write them, results = the counters
  * OUTPUTS: none
  * RETURNS: voide
  ************************************************/
-void output_pred_results()
+void output_pred_results( JOB *job, TEST_RESULTS *results )
 {
+	int i;
+
 	if (verbose)	{
 		/* Print only the percentage of pairs correct & percentage when time is correct */
-		printf("NumTests=%d, FallbackNumCorrect=%d, Number_fallbacks_to_zero=%d\n",
-			NumTests,			// number of tests
-			FallbackNumCorrect,		// number of times it fell back to level 0
+		fprintf(job->out, "NumTests=%d, FallbackNumCorrect=%d, Number_fallbacks_to_zero=%d\n",
+			results->NumTests,			// number of tests
+			results->FallbackNumCorrect,		// number of times it fell back to level 0
 									// but was still correct
-			FallbackNum);	// number of times it fell back to 0, wrong or right prediction
+			results->FallbackNum);	// number of times it fell back to 0, wrong or right prediction
 	
 		}
 	else {
 		// Overall Results
 		//printf("   <MaxOrder>%d</MaxOrder>\n", max_order);
-		printf("   <NumTests>%d</NumTests>\n", NumTests);
+		fprintf(job->out, "   <NumTests>%d</NumTests>\n", results->NumTests);
 		// Results for predictions that went to Fallback
-		printf("   <FallbackNum>%d</FallbackNum>\n", FallbackNum);
-		printf("   <FallbackNumCorrect>%d</FallbackNumCorrect>\n", FallbackNumCorrect);
-		if (confidence_level < 0)	{	// normal output
+		fprintf(job->out, "   <FallbackNum>%d</FallbackNum>\n", results->FallbackNum);
+		fprintf(job->out, "   <FallbackNumCorrect>%d</FallbackNumCorrect>\n", results->FallbackNumCorrect);
+		if (job->confidence_level == ALL_CONFIDENCE_LEVELS && research_question == WHEN)	{
+			/****
+			 *  Results for every confidence level, in one block
+			******/
+			fprintf(job->out, "   <ConfidenceLevels>\n");
+			for (i = 0; i < NUM_CONFIDENCE_LEVELS; i++)
+				fprintf(job->out, "   <ConfidenceLevel value=\"%d\"><NumCorrect>%d</NumCorrect><NumPredictions>%ld</NumPredictions></ConfidenceLevel>\n",
+						i, results->Level_NumCorrect[i], results->Level_NumPredictions[i]);
+			fprintf(job->out, "   </ConfidenceLevels>\n");
+		}
+		else if (job->confidence_level < 0)	{	// normal output
 			/****
 			 *  Results for most likely predictions
 			******/
-			printf("   <MostProb_NumCorrect>%d</MostProb_NumCorrect>\n", MostProb_NumCorrect);
+			fprintf(job->out, "   <MostProb_NumCorrect>%d</MostProb_NumCorrect>\n", results->MostProb_NumCorrect);
 			if (research_question == WHERE)
-				printf("   <MostProb_NeighborCorrect>%d</MostProb_NeighborCorrect>\n", MostProb_NeighborCorrect);
+				fprintf(job->out, "   <MostProb_NeighborCorrect>%d</MostProb_NeighborCorrect>\n", results->MostProb_NeighborCorrect);
 			else // research_question == WHEN
 			{
-				printf("   <MostProb_Within10Minutes>%d</MostProb_Within10Minutes>\n", MostProb_Within10Minutes);
-				printf("   <MostProb_Within20Minutes>%d</MostProb_Within20Minutes>\n", MostProb_Within20Minutes);			
+				fprintf(job->out, "   <MostProb_Within10Minutes>%d</MostProb_Within10Minutes>\n", results->MostProb_Within10Minutes);
+				fprintf(job->out, "   <MostProb_Within20Minutes>%d</MostProb_Within20Minutes>\n", results->MostProb_Within20Minutes);			
 			}
-			printf("   <MostProb_MultiplePredictions>%d</MostProb_MultiplePredictions>\n", MostProb_MultiplePredictions);
+			fprintf(job->out, "   <MostProb_MultiplePredictions>%d</MostProb_MultiplePredictions>\n", results->MostProb_MultiplePredictions);
 			/****
 			 *  Results for less likely predictions
 			******/
-			printf("   <LessProb_NumCorrect>%d</LessProb_NumCorrect>\n", LessProb_NumCorrect);
+			fprintf(job->out, "   <LessProb_NumCorrect>%d</LessProb_NumCorrect>\n", results->LessProb_NumCorrect);
 			if (research_question == WHERE)
-				printf("   <LessProb_NeighborCorrect>%d</LessProb_NeighborCorrect>\n", LessProb_NeighborCorrect);
+				fprintf(job->out, "   <LessProb_NeighborCorrect>%d</LessProb_NeighborCorrect>\n", results->LessProb_NeighborCorrect);
 			else // research_question == WHEN
 			{
-				printf("   <LessProb_Within10Minutes>%d</LessProb_Within10Minutes>\n", LessProb_Within10Minutes);
-				printf("   <LessProb_Within20Minutes>%d</LessProb_Within20Minutes>\n", LessProb_Within20Minutes);			
+				fprintf(job->out, "   <LessProb_Within10Minutes>%d</LessProb_Within10Minutes>\n", results->LessProb_Within10Minutes);
+				fprintf(job->out, "   <LessProb_Within20Minutes>%d</LessProb_Within20Minutes>\n", results->LessProb_Within20Minutes);			
 			}
-			printf("   <LessProb_MultiplePredictions>%d</LessProb_MultiplePredictions>\n", LessProb_MultiplePredictions);
+			fprintf(job->out, "   <LessProb_MultiplePredictions>%d</LessProb_MultiplePredictions>\n", results->LessProb_MultiplePredictions);
 		}	// end of normal output
 		else {				// using confidence level
 			/****
 			 *  Results for most likely predictions
 			******/
-			printf("   <ConfidenceLevel>%d</ConfidenceLevel>\n", confidence_level);
-			printf("   <ConfidenceLevel_NumCorrect>%d</ConfidenceLevel_NumCorrect>\n", MostProb_NumCorrect);
+			fprintf(job->out, "   <ConfidenceLevel>%d</ConfidenceLevel>\n", job->confidence_level);
+			fprintf(job->out, "   <ConfidenceLevel_NumCorrect>%d</ConfidenceLevel_NumCorrect>\n", results->MostProb_NumCorrect);
 		}
 	
 	}
@@ -1210,10 +2011,11 @@ void output_pred_results()
  * INPUTS: time1 = 16bit code for a time
  * 		time2 = 16bit code for another time
  * 		range = number of MINUTES to see if they are in range.
+ * 		out = where to write errors (with the rest of the results)
  * RETURNS: TRUE if they are in range (|symbol2 - symbol1| <= range)
  * 	FALSE if they are not or an error occurred.
  *********************************************************************/
-unsigned char within_time_window( SYMBOL_TYPE time1, SYMBOL_TYPE time2, int range)
+unsigned char within_time_window( SYMBOL_TYPE time1, SYMBOL_TYPE time2, int range, FILE *out)
 {
 	int ts1=0, ts2=0, i;
 	// Find codes in timeslot_map
@@ -1223,7 +2025,7 @@ unsigned char within_time_window( SYMBOL_TYPE time1, SYMBOL_TYPE time2, int rang
 			break;
 		}
 	if (i==1441) { 	// code not found
-		printf("within_time_window: timecode 0x%4x not found.\n", time1);
+		fprintf(out, "within_time_window: timecode 0x%4x not found.\n", time1);
 		return (FALSE);
 		}
 	for (i=0; i < 1441; i++)
@@ -1232,7 +2034,7 @@ unsigned char within_time_window( SYMBOL_TYPE time1, SYMBOL_TYPE time2, int rang
 			break;
 		}
 	if (i==1441) { 	// code not found
-		printf("within_time_window: timecode 0x%4x not found.\n", time2);
+		fprintf(out, "within_time_window: timecode 0x%4x not found.\n", time2);
 		return (FALSE);
 		}
 	
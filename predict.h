@@ -1,15 +1,124 @@
 #ifndef PREDICT_H_
 #define PREDICT_H_
 
+#include "writer.h"		// for writing the number of predictions on a background thread
+
 #define FALSE	0
 #define TRUE ~FALSE
+
+#define ALL_CONFIDENCE_LEVELS	-2		// -c all: test every confidence level from 0 to 100 at once
+#define NUM_CONFIDENCE_LEVELS	101
+
+/*
+ * Counters used to count up the results of the predictions
+ * made by predict_test().  One of these is filled in per test.
+ */
+typedef struct {
+	int num_tested, num_right;		// test results
+	int NumTests;
+	int FallbackNumCorrect;  // number of times it fell to level 0 and was still right.
+	int FallbackNum;	// number of times model went to level 0 for a prediction
+	//Counters for most likely predictions
+	int MostProb_NumCorrect;		// # times one of the most probably predictions was right
+									// (also used to count confidence_level predictions)
+	int MostProb_NeighborCorrect;	// number of times the most prob prediction was wrong, but one of
+									// it's neighboring APs is correct answer (WHERE only)
+	int MostProb_Within10Minutes;	// (WHERE case) # times right answer within 10 minutes of one
+									// of the predictions
+	int MostProb_Within20Minutes;	// (WHERE case) # times right answer is within 20 minutes of
+									// one of the most likely predictions
+	int MostProb_MultiplePredictions; // # times the Most Probable list included > 1 prediction.
+	// Counters for the less likely predictions
+	int LessProb_NumCorrect;		// # times one of the less probable predictions was right
+	int LessProb_NeighborCorrect;	// number of times one of the less prob prediction was wrong, but one of
+									// it's neighboring APs is correct answer (WHERE only)
+	int LessProb_Within10Minutes;	// (WHERE case) # times right answer within 10 minutes of one
+									// of the predictions
+	int LessProb_Within20Minutes;	// (WHERE case) # times right answer is within 20 minutes of
+									// one of the most likely predictions
+	int LessProb_MultiplePredictions; // # times the Less Probable list included > 1 prediction.
+
+	int number_multiple_predictions; //number fo times model made > 1 prediction for a given time.
+	int number_times_neighbors_are_correct;	// number of times the prediction is a neighbor of actual
+
+	// Counters for -c all, one for each confidence level from 0 to 100
+	int Level_NumCorrect[ NUM_CONFIDENCE_LEVELS ];		// # times one of the level's predictions was right
+	long Level_NumPredictions[ NUM_CONFIDENCE_LEVELS ];	// total number of predictions the level used
+} TEST_RESULTS;
+
+/*
+ * A JOB is one training and test run: what main() does for one command
+ * line, or one line of a -batch file.  Its results go to 'out' and its
+ * number-of-predictions lines to 'num_pred_file' (stdout and num_pred.csv
+ * for a single run).  A batch job writes them into memory (out_text and
+ * num_pred_text) so they can be printed in order when it's done.
+ */
+typedef struct {
+	int function;						// PREDICT_TEST or LOGLOSS_EVAL
+	char training_file_name[ 81 ];
+	char test_file_name[ 81 ];
+	int max_order;						// order of the model to train
+	int confidence_level;				// as with -c
+	FILE *training_file;
+	FILE *test_file;
+	FILE *out;							// where the results go
+	FILE *num_pred_file;				// where the number of predictions go
+	char *out_text;						// (a batch job's results ...
+	size_t out_bytes;
+	char *num_pred_text;				// ... and number of predictions)
+	size_t num_pred_bytes;
+	RESULTS_STREAM num_preds;			// the number-of-predictions lines on their way to num_pred_file
+} JOB;
+
+/*
+ * The jobs in a -batch file, and what each worker thread needs to
+ * run them: its own model (which is reset for each job, keeping its
+ * memory) and its own scratch.
+ */
+typedef struct {
+	JOB *jobs;
+	int num_jobs;
+	MODEL *models;			// one per worker
+	MODEL_SCRATCH *scratches;	// one per worker
+} BATCH;
+
+/*
+ * A FOLD of a cross-validation (-cv) is tested on one segment of the
+ * training file, with a model trained on the segments before it (or
+ * with -cv_window, on the last few of them).  The offsets are symbol
+ * numbers in the training file.
+ */
+typedef struct {
+	int train_start;		// trained on symbols train_start .. test_start-1
+	int test_start;			// tested on symbols test_start .. test_end-1
+	int test_end;
+	MODEL model;			// its model (frozen once it's trained)
+	JOB job;				// where its results go
+} FOLD;
+
+/*
+ * A cross-validation: the whole training file, read in (or mapped)
+ * once, its folds, and a scratch for each worker thread that tests them.
+ */
+typedef struct {
+	STRING16 *trace;
+	FOLD *folds;
+	int num_folds;
+	MODEL_SCRATCH *scratches;	// one per worker
+} CROSS_VALIDATION;
+
 /*
  * Declarations for local procedures.
  */
 int initialize_options( int argc, char **argv );
+void print_research_question( void );
+int num_pred_lines( int level );
+void train_model( MODEL *model, FILE *training_file );
+int train_on_symbols( MODEL *model, const SYMBOL_TYPE *symbols, int length, int flip );
 int check_compression( void );
 //void print_compression( void );
-void predict_test( STRING16 * test_string);
+void predict_test( MODEL *model, MODEL_SCRATCH *scratch, JOB *jobs, int num_jobs);
+void predict_test_sweep( MODEL *model, MODEL_SCRATCH *scratch, JOB *jobs, int num_jobs);
 #ifdef NOTUSEDIN16BITVERSION
 void remove_delimiters( char * str_input, char * str_purge);
 void strpurge( char * str_in, char ch_purge);
@@ -20,19 +129,37 @@ int get_boxstring_type( int index_into_input_string);
 int get_loctimestring_type( SYMBOL_TYPE symbol);
 int get_binboxstring_type( SYMBOL_TYPE symbol);
 int get_bindowts_type( SYMBOL_TYPE symbol);
-unsigned char neighboring_ap( SYMBOL_TYPE predicted_ap, SYMBOL_TYPE actual_ap);
+unsigned char neighboring_ap( SYMBOL_TYPE predicted_ap, SYMBOL_TYPE actual_ap, FILE *out);
 int get_hhmm_from_code( SYMBOL_TYPE code, char * dest);
 void test_timecode();
 char * get_str_mappings(int mapping);
-void build_test_string(STRING16 * test_string);
-void analyze_pred_results( SYMBOL_TYPE correct_answer, SYMBOL_TYPE context);
-void output_pred_results(void);
-unsigned char within_time_window( SYMBOL_TYPE time1, SYMBOL_TYPE time2, int range);
+int build_test_string(STRING16 * test_string);
+void analyze_pred_results( JOB *job, TEST_RESULTS *results, PREDICTION_VIEW *pred, SYMBOL_TYPE correct_answer, SYMBOL_TYPE context);
+void analyze_confidence_levels( TEST_RESULTS *results, PREDICTION_VIEW *pred, SYMBOL_TYPE correct_answer);
+void output_pred_results( JOB *job, TEST_RESULTS *results );
+void read_batch( BATCH *batch );
+int compare_job_sizes( const void *a, const void *b );
+void run_batch( void );
+void run_batch_job( void *context, int worker, int job_number );
+void run_job( JOB *job, MODEL *model, MODEL_SCRATCH *scratch );
+void read_folds( CROSS_VALIDATION *cv );
+void cross_validate( MODEL *model );
+void run_fold( void *context, int worker, int fold_number );
+unsigned char within_time_window( SYMBOL_TYPE time1, SYMBOL_TYPE time2, int range, FILE *out);
 
 /* Function Types */
 #define NO_FUNCTION		0
 #define PREDICT_TEST	1
 #define LOGLOSS_EVAL	2
+#define BATCH_RUN		3
+#define CROSS_VALIDATE	4
+
+/* What analyze_pred_results() writes to num_pred.csv (see num_pred_lines()) */
+#define NO_NUM_PRED_LINES			0
+#define BEST_NUM_PRED_LINES			1
+#define CONFIDENCE_NUM_PRED_LINES	2
+
+#define MAX_SWEEP_ORDERS	8	// an -o sweep tests orders 0 to 7 at most (the most a model can have)
 
 /* String Types (types of input strings) */
 #define NONE			0
@@ -9,12 +9,21 @@
  * 
  * *****************************************************/
 #include <stdlib.h>			// for calloc(), free()
+#include <string.h>			// for memmove()
 #include <assert.h>			// for assert()
 #include <stdio.h>			// for sprintf()
-#include "model.h"			// for MAX_STRING_LENGTH definition
+#ifndef NO_MMAP
+#include <sys/mman.h>		// for mmap(), to read input files without copying them
+#include <sys/stat.h>		// for fstat()
+#endif
 #include "string16.h"
+#if defined(__AVX2__)
+#include <immintrin.h>		// for the 16-symbol AVX2 compare in find_symbol16() (and swap_pairs16())
+#elif defined(__SSE2__)
+#include <emmintrin.h>		// for the 8-symbol SSE2 compare in find_symbol16() (and swap_pairs16())
+#endif
 
-char printable_string16[5 * MAX_STRING_LENGTH+1]; 
+char printable_string16[5 * MAX_FORMAT_LENGTH16+1]; 
 
 /* Constructor string16
  * Create a string of 16-bit values; return a pointer to the string 
@@ -32,9 +41,83 @@ STRING16 * string16(int length){
     return(new_string16);
 }
 
+/* map_string16 - Return the whole of the given file (opened for
+ * reading, and not read from yet) as a read-only string, by mapping
+ * it instead of reading it in.  The string must not be changed.  NULL
+ * means the file can't be mapped (it's a pipe, say, or it's empty),
+ * and it will have to be read in with fread16().
+ */
+STRING16 * map_string16( FILE *src_file){
+#ifndef NO_MMAP
+	STRING16 * new_string16;
+	struct stat file_status;
+	void *map_start;
+
+	if (fstat( fileno( src_file), &file_status) != 0 ||
+			!S_ISREG( file_status.st_mode) ||
+			file_status.st_size < (off_t) sizeof( SYMBOL_TYPE))
+		return NULL;
+	map_start = mmap( NULL, file_status.st_size, PROT_READ, MAP_SHARED, fileno( src_file), 0);
+	if (map_start == MAP_FAILED)
+		return NULL;
+	madvise( map_start, file_status.st_size, MADV_SEQUENTIAL);	// it's read from front to back
+	new_string16 = (STRING16 *) calloc(sizeof(STRING16), 1);
+	if (new_string16 == NULL)	{
+		munmap( map_start, file_status.st_size);
+		return NULL;
+	}
+	new_string16->s = (SYMBOL_TYPE *) map_start;
+	new_string16->length = file_status.st_size / sizeof( SYMBOL_TYPE);
+	new_string16->max_length = new_string16->length;
+	new_string16->mapping_bytes = file_status.st_size;
+	return(new_string16);
+#else
+	return NULL;
+#endif
+}
+
+/* fread16_all - Return the whole of the given file (opened for reading,
+ * and not read from yet) as a string: mapped if it can be (see
+ * map_string16(), and then it must not be changed), or else read in.
+ * NULL means there wasn't the memory for it.
+ */
+STRING16 * fread16_all( FILE *src_file){
+	STRING16 * new_string16;
+	SYMBOL_TYPE * ptr_array;
+	int i, n;
+
+	new_string16 = map_string16( src_file);
+	if (new_string16 != NULL)
+		return(new_string16);
+	new_string16 = string16( 4096);
+	if (new_string16 == NULL)
+		return NULL;
+	for ( ; ; ) {
+		n = new_string16->max_length - new_string16->length - 1;	// (room for the null)
+		i = fread( new_string16->s + new_string16->length, sizeof( SYMBOL_TYPE), n, src_file);
+		new_string16->length += i;
+		if (i < n)
+			break;				// that's the end of the file
+		ptr_array = (SYMBOL_TYPE *) realloc( new_string16->s, 2 * new_string16->max_length * sizeof( SYMBOL_TYPE));
+		if (ptr_array == NULL)	{
+			delete_string16( new_string16);
+			return NULL;
+		}
+		new_string16->s = ptr_array;
+		new_string16->max_length *= 2;
+	}
+	new_string16->s[ new_string16->length ] = 0x00;
+	return(new_string16);
+}
+
 /* Deconstructor - Delete string
  */
 void delete_string16( STRING16 * str16_to_delete)	{
+#ifndef NO_MMAP
+	if (str16_to_delete->mapping_bytes != 0)
+		munmap( str16_to_delete->s, str16_to_delete->mapping_bytes);	// unmap the file
+	else
+#endif
 	free( str16_to_delete->s);	// de-allocate the array
 	free (str16_to_delete);		// de-allocate the structure
 	str16_to_delete = NULL;
@@ -69,6 +152,8 @@ STRING16 * strncpy16( STRING16 *dest, STRING16 *src, int offset, int n)	{
 /* format a STRING16 into a string of printable characters
  * FYI: Currently, this routine stores the result in global
  * memory to avoid memory leakage (if I allocated the string)
+ * Only the first MAX_FORMAT_LENGTH16 symbols are formatted; use
+ * print_string16() for longer strings.
  */ 
 char * format_string16( STRING16 *s16)	{
 	char * dest;
@@ -78,8 +163,8 @@ char * format_string16( STRING16 *s16)	{
 	dest = printable_string16;
 	src = s16->s;
 
-	for (i = 0; i < s16->length && i < 5 * MAX_STRING_LENGTH; ) {
-		for (j=0; j < 8 && (s16->length-i > 0); j++, i++)	{
+	for (i = 0; i < s16->length && i < MAX_FORMAT_LENGTH16; ) {
+		for (j=0; j < 8 && (s16->length-i > 0) && i < MAX_FORMAT_LENGTH16; j++, i++)	{
 			sprintf( dest, "%04x ",  *src);
 			dest += 5;
 			src++;
@@ -90,6 +175,17 @@ char * format_string16( STRING16 *s16)	{
 	return (printable_string16);
 }
 
+/* print_string16 - print a STRING16 the way format_string16() formats
+ * it, however long it is.  If flip is 1, the symbols of each pair
+ * are printed the other way round (see get_flipped_symbol()).
+ */
+void print_string16( FILE *dest_file, STRING16 *s16, int flip)	{
+	int i;
+
+	for (i = 0; i < s16->length; i++)
+		fprintf( dest_file, "%04x ", get_flipped_symbol( s16, i, flip));
+}
+
 /* Remove the first symbol from the string, shortening it by one symbol */
 void shorten_string16( STRING16 *s16){
 	int i;
@@ -106,6 +202,18 @@ SYMBOL_TYPE get_symbol( STRING16 *s16, int offset){
 	return(s16->s[offset]);
 }
 
+/* Return the symbol at the given offset of the given string, or if flip
+ * is 1, the other symbol of its pair: so symbols 1,0,3,2,5,4... are
+ * returned for offsets 0,1,2,3,4,5...  This flips the pairs of a string
+ * that can't be changed (a mapped one).  A last symbol that has no
+ * partner is returned as it is.
+ */
+SYMBOL_TYPE get_flipped_symbol( STRING16 *s16, int offset, int flip){
+	if ((offset ^ flip) < s16->length)
+		offset ^= flip;
+	return(s16->s[offset]);
+}
+
 /* Put the symbol at the given offset of the given string. */
 void put_symbol( STRING16 *s16, int offset, SYMBOL_TYPE symbol){
 	//assert( offset <= s16->length);
@@ -115,11 +223,14 @@ void put_symbol( STRING16 *s16, int offset, SYMBOL_TYPE symbol){
 
 /* read from a file into a STRING16 structure.
  * It's assumed that the file contains nothing but 16-bit signed
- * integers.
+ * integers.  A mapped string (see map_string16()) already holds all
+ * of the file, so there is never any more to read into it.
  */
 int fread16( STRING16 *dest, int max_length, FILE *src_file){
 	int i;
 	
+	if (dest->mapping_bytes != 0)
+		return(0);
 	i = fread( dest->s, sizeof( SYMBOL_TYPE), max_length, src_file);
 	dest->length = i;
 	dest->s[ i ] = 0x00;		// terminate 'string' with a null. (this should 
@@ -127,3 +238,96 @@ int fread16( STRING16 *dest, int max_length, FILE *src_file){
 	return(i);
 }
 
+/* fread16_more - read the next part of a file into a STRING16, after
+ * the last 'keep' symbols that were in it (which are moved up to the
+ * front).  This lets a file be read a piece at a time while the symbols
+ * just before each piece are still at hand.  Returns the number of new
+ * symbols read, which start at dest->length minus that number.  (As
+ * with fread16(), that's always 0 for a mapped string.)
+ */
+int fread16_more( STRING16 *dest, int keep, FILE *src_file){
+	int i;
+
+	if (dest->mapping_bytes != 0)
+		return(0);
+	if (keep > dest->length)
+		keep = dest->length;
+	assert( keep < dest->max_length);
+	memmove( dest->s, dest->s + dest->length - keep, keep * sizeof( SYMBOL_TYPE));
+	i = fread( dest->s + keep, sizeof( SYMBOL_TYPE), dest->max_length - keep - 1, src_file);
+	dest->length = keep + i;
+	dest->s[ dest->length ] = 0x00;
+	return(i);
+}
+
+
+/* find_symbol16 - Return the index of the first element of array[0..n-1]
+ * that equals symbol, or -1 if it isn't there.  This is the search used
+ * on the symbols[] array of every context table, so when the compiler
+ * targets SSE2 (8 symbols at a time) or AVX2 (16 symbols at a time) the
+ * symbols are compared a whole vector at once.  The leftover symbols at
+ * the end of the array (and every symbol on other processors) are
+ * checked one at a time.
+ */
+int find_symbol16( const SYMBOL_TYPE *array, int n, SYMBOL_TYPE symbol){
+	int i = 0;
+#if defined(__AVX2__)
+	__m256i target = _mm256_set1_epi16( symbol);
+	unsigned int mask;
+
+	for ( ; i + 16 <= n; i += 16) {
+		mask = (unsigned int) _mm256_movemask_epi8( _mm256_cmpeq_epi16( target,
+					_mm256_loadu_si256( (const __m256i *) (array + i))));
+		if (mask != 0)
+			return (i + __builtin_ctz( mask) / 2);	// 2 mask bits per symbol
+	}
+#elif defined(__SSE2__)
+	__m128i target = _mm_set1_epi16( symbol);
+	unsigned int mask;
+
+	for ( ; i + 8 <= n; i += 8) {
+		mask = (unsigned int) _mm_movemask_epi8( _mm_cmpeq_epi16( target,
+					_mm_loadu_si128( (const __m128i *) (array + i))));
+		if (mask != 0)
+			return (i + __builtin_ctz( mask) / 2);	// 2 mask bits per symbol
+	}
+#endif
+	for ( ; i < n; i++)
+		if (array[i] == symbol)
+			return (i);
+	return (-1);
+}
+
+/* swap_pairs16 - Swap the symbols of each pair in array[0..n-1]: the
+ * first with the second, the third with the fourth, and so on, so that
+ * T1,L1,T2,L2... becomes L1,T1,L2,T2...  (n should be even; if it isn't
+ * the last symbol is left where it is.)  A pair is a 32-bit word, so
+ * swapping it is a 16-bit rotate, which SSE2 does 4 pairs at a time
+ * and AVX2 8 pairs at a time.
+ */
+void swap_pairs16( SYMBOL_TYPE *array, int n){
+	int i = 0;
+	SYMBOL_TYPE symbol;
+#if defined(__AVX2__)
+	__m256i pairs;
+
+	for ( ; i + 16 <= n; i += 16) {
+		pairs = _mm256_loadu_si256( (const __m256i *) (array + i));
+		_mm256_storeu_si256( (__m256i *) (array + i),
+				_mm256_or_si256( _mm256_slli_epi32( pairs, 16), _mm256_srli_epi32( pairs, 16)));
+	}
+#elif defined(__SSE2__)
+	__m128i pairs;
+
+	for ( ; i + 8 <= n; i += 8) {
+		pairs = _mm_loadu_si128( (const __m128i *) (array + i));
+		_mm_storeu_si128( (__m128i *) (array + i),
+				_mm_or_si128( _mm_slli_epi32( pairs, 16), _mm_srli_epi32( pairs, 16)));
+	}
+#endif
+	for ( ; i + 1 < n; i += 2) {
+		symbol = array[i];
+		array[i] = array[i+1];
+		array[i+1] = symbol;
+	}
+}
@@ -10,17 +10,23 @@
 #define STRING16_H_
 
 #include <stdio.h>		// for file I/O
+#include <stddef.h>		// for size_t
 
 typedef signed short int SYMBOL_TYPE;
 
+#define MAX_FORMAT_LENGTH16	256		// longest string format_string16() formats
+
 typedef struct {
 	int max_length;		// allocated length of array
 	SYMBOL_TYPE *s;		// pointer to allocated memory
 	int length;		// length of string
+	size_t mapping_bytes;	// if s is a mapped file, the length of the mapping (else 0)
 } STRING16;
 
 /* Function Prototypes */
 STRING16 * string16(int length);
+STRING16 * map_string16( FILE *src_file);
+STRING16 * fread16_all( FILE *src_file);
 void delete_string16( STRING16 * str16_to_delete);
 int strlen16( STRING16 * s);
 void set_strlen16( STRING16 * s, int len);
@@ -28,8 +34,13 @@ STRING16 * strncpy16( STRING16 *dest, STRING16 *src, int offset, int n);
 char * format_string16( STRING16 *s16);
 void shorten_string16( STRING16 *s16);
 SYMBOL_TYPE get_symbol( STRING16 *s16, int offset);
+SYMBOL_TYPE get_flipped_symbol( STRING16 *s16, int offset, int flip);
 int fread16( STRING16 *dest, int max_length, FILE *src_file);
+int fread16_more( STRING16 *dest, int keep, FILE *src_file);
+void print_string16( FILE *dest_file, STRING16 *s16, int flip);
 void put_symbol( STRING16 *s16, int offset, SYMBOL_TYPE symbol);
+int find_symbol16( const SYMBOL_TYPE *array, int n, SYMBOL_TYPE symbol);
+void swap_pairs16( SYMBOL_TYPE *array, int n);
 
 
 
@@ -0,0 +1,174 @@
+/*******************************************************
+ * writer.c
+ *
+ * This module formats and writes the per-prediction
+ * results on a background thread.  See writer.h.
+ *
+ * *****************************************************/
+#include <stdlib.h>			// for malloc(), free()
+#include "writer.h"
+
+/* write_block - format a block's records into its stream's file. */
+static void write_block( RESULTS_BLOCK *b) {
+	RESULTS_STREAM *s = b->stream;
+	RESULTS_RECORD *r;
+	int i;
+
+	for (i = 0; i < b->num_records; i++) {
+		r = &b->records[ i ];
+		fprintf( s->file, "%s, %d, %d, %d\n", s->name, r->values[ 0 ], r->values[ 1 ], r->values[ 2 ]);
+	}
+}
+
+/* run_writer - the body of the writer thread: write the queued blocks
+ * in turn, until it's stopped and the queue is empty.
+ */
+static void * run_writer( void *arg) {
+	RESULTS_WRITER *w = (RESULTS_WRITER *) arg;
+	RESULTS_BLOCK *b;
+
+	pthread_mutex_lock( &w->lock);
+	for ( ; ; ) {
+		while (w->head == NULL && !w->stopping)
+			pthread_cond_wait( &w->queued, &w->lock);
+		if (w->head == NULL)
+			break;
+		b = w->head;
+		w->head = b->next;
+		if (w->head == NULL)
+			w->tail = NULL;
+		pthread_mutex_unlock( &w->lock);
+		write_block( b);
+		pthread_mutex_lock( &w->lock);
+		b->stream->num_pending--;
+		b->next = w->free_blocks;
+		w->free_blocks = b;
+		w->num_busy--;
+		pthread_cond_broadcast( &w->written);
+	}
+	pthread_mutex_unlock( &w->lock);
+	return (NULL);
+}
+
+/* get_block - take a block to fill, from the free list, or a new one.
+ * Once RESULTS_MAX_BLOCKS have been allocated, wait for the writer to
+ * give one back (unless it has none to give, since each producer holds
+ * on to the block it's filling).  Called with the lock held.
+ */
+static RESULTS_BLOCK * get_block( RESULTS_WRITER *w) {
+	RESULTS_BLOCK *b;
+
+	while (w->free_blocks == NULL && w->num_blocks >= RESULTS_MAX_BLOCKS && w->num_busy > 0)
+		pthread_cond_wait( &w->written, &w->lock);
+	if (w->free_blocks != NULL) {
+		b = w->free_blocks;
+		w->free_blocks = b->next;
+	}
+	else {
+		b = (RESULTS_BLOCK *) malloc( sizeof( RESULTS_BLOCK));
+		if (b == NULL) {
+			fprintf( stderr, "Had trouble allocating the results writer's buffers!\n");
+			exit( -1);
+		}
+		w->num_blocks++;
+	}
+	b->next = NULL;
+	b->num_records = 0;
+	return (b);
+}
+
+/* results_writer_start - set up the writer, and start its thread.  If
+ * the thread can't be started, each block is written as soon as it's
+ * full, by the producer.
+ */
+void results_writer_start( RESULTS_WRITER *w ) {
+	w->stopping = 0;
+	w->head = w->tail = NULL;
+	w->free_blocks = NULL;
+	w->num_blocks = 0;
+	w->num_busy = 0;
+	pthread_mutex_init( &w->lock, NULL);
+	pthread_cond_init( &w->queued, NULL);
+	pthread_cond_init( &w->written, NULL);
+	w->started = (pthread_create( &w->thread, NULL, run_writer, w) == 0);
+}
+
+/* results_writer_stop - write whatever is still queued, stop the thread,
+ * and free the blocks.  Every stream must have been closed.
+ */
+void results_writer_stop( RESULTS_WRITER *w ) {
+	RESULTS_BLOCK *b;
+
+	if (w->started) {
+		pthread_mutex_lock( &w->lock);
+		w->stopping = 1;
+		pthread_cond_signal( &w->queued);
+		pthread_mutex_unlock( &w->lock);
+		pthread_join( w->thread, NULL);
+	}
+	while ((b = w->free_blocks) != NULL) {
+		w->free_blocks = b->next;
+		free( b);
+	}
+	pthread_mutex_destroy( &w->lock);
+	pthread_cond_destroy( &w->queued);
+	pthread_cond_destroy( &w->written);
+}
+
+/* results_stream_open - start a stream of lines with the given name
+ * going to the given file.  The name must last until it's closed.
+ */
+void results_stream_open( RESULTS_STREAM *s, RESULTS_WRITER *w, FILE *file, const char *name ) {
+	s->writer = w;
+	s->file = file;
+	s->name = name;
+	s->block = NULL;
+	s->num_pending = 0;
+}
+
+/* results_hand_off - queue the stream's block (if it has any records in
+ * it) for the writer, and give the stream an empty one.
+ */
+void results_hand_off( RESULTS_STREAM *s ) {
+	RESULTS_WRITER *w = s->writer;
+	RESULTS_BLOCK *b = s->block;
+
+	if (b != NULL && b->num_records > 0 && !w->started) {
+		write_block( b);
+		b->num_records = 0;
+		return;
+	}
+	pthread_mutex_lock( &w->lock);
+	if (b != NULL && b->num_records > 0) {
+		b->stream = s;
+		if (w->tail == NULL)
+			w->head = b;
+		else
+			w->tail->next = b;
+		w->tail = b;
+		w->num_busy++;
+		s->num_pending++;
+		pthread_cond_signal( &w->queued);
+		b = NULL;
+	}
+	s->block = (b != NULL) ? b : get_block( w);
+	pthread_mutex_unlock( &w->lock);
+}
+
+/* results_stream_close - write the rest of the stream's lines, and wait
+ * until they've all been written, so its file can be used (or closed).
+ */
+void results_stream_close( RESULTS_STREAM *s ) {
+	RESULTS_WRITER *w = s->writer;
+
+	if (s->block == NULL)
+		return;
+	results_hand_off( s);
+	pthread_mutex_lock( &w->lock);
+	while (s->num_pending > 0)
+		pthread_cond_wait( &w->written, &w->lock);
+	s->block->next = w->free_blocks;
+	w->free_blocks = s->block;
+	s->block = NULL;
+	pthread_mutex_unlock( &w->lock);
+}
@@ -0,0 +1,88 @@
+/**************************************************
+ * writer.h
+ *
+ * Prototypes for a results writer: a background thread that
+ * formats and writes the per-prediction CSV lines (num_pred.csv),
+ * so the prediction loop doesn't wait on stdio.  Each producer
+ * (a job, on whatever thread runs it) appends fixed-size binary
+ * records to a block of its own, without taking any lock.  A full
+ * block is queued for the writer thread, which formats it into the
+ * producer's file and hands the block back for reuse.  A producer's
+ * lines come out in the order they were appended, just as if they
+ * had been written with fprintf() as they went.
+ *
+ * ************************************************/
+
+#ifndef WRITER_H_
+#define WRITER_H_
+
+#include <stdio.h>
+#include <pthread.h>
+
+#define RESULTS_BLOCK_RECORDS	4096	// records per block
+#define RESULTS_MAX_BLOCKS		64		// blocks to allocate before a producer waits for the writer
+
+/*
+ * One line of results: the fields after the line's name (which is the
+ * same for every line from a producer).  It's written as
+ * 		name, values[0], values[1], values[2]
+ */
+typedef struct {
+	int values[ 3 ];
+} RESULTS_RECORD;
+
+typedef struct RESULTS_BLOCK {
+	struct RESULTS_BLOCK *next;	// next in the writer's queue or free list
+	struct RESULTS_STREAM *stream;	// whose records these are
+	int num_records;
+	RESULTS_RECORD records[ RESULTS_BLOCK_RECORDS ];
+} RESULTS_BLOCK;
+
+typedef struct {
+	pthread_t thread;
+	int started;				// false if the thread couldn't be started (then blocks are written as they fill)
+	int stopping;				// true once results_writer_stop() has been called
+	pthread_mutex_t lock;		// guards everything below
+	pthread_cond_t queued;		// signalled when a block is queued (or the writer is stopping)
+	pthread_cond_t written;		// broadcast when a block has been written
+	RESULTS_BLOCK *head, *tail;	// the blocks waiting to be written
+	RESULTS_BLOCK *free_blocks;	// blocks ready for reuse
+	int num_blocks;				// number allocated
+	int num_busy;				// number queued or being written
+} RESULTS_WRITER;
+
+/*
+ * A RESULTS_STREAM is one producer's lines, all going to one file.
+ * Only the producer touches 'block'; the writer's lock guards num_pending.
+ */
+typedef struct RESULTS_STREAM {
+	RESULTS_WRITER *writer;
+	FILE *file;
+	const char *name;			// the first field of each line
+	RESULTS_BLOCK *block;		// the block being filled (NULL until the first record)
+	int num_pending;			// blocks handed to the writer but not written yet
+} RESULTS_STREAM;
+
+/* Function Prototypes */
+void results_writer_start( RESULTS_WRITER *w );
+void results_writer_stop( RESULTS_WRITER *w );
+void results_stream_open( RESULTS_STREAM *s, RESULTS_WRITER *w, FILE *file, const char *name );
+void results_stream_close( RESULTS_STREAM *s );
+void results_hand_off( RESULTS_STREAM *s );
+
+/*
+ * results_append - add a line to the stream.  This only waits for the
+ * writer when a block fills up and the writer is too far behind.
+ */
+static inline void results_append( RESULTS_STREAM *s, int value0, int value1, int value2 ) {
+	RESULTS_RECORD *r;
+
+	if (s->block == NULL || s->block->num_records == RESULTS_BLOCK_RECORDS)
+		results_hand_off( s);
+	r = &s->block->records[ s->block->num_records++ ];
+	r->values[ 0 ] = value0;
+	r->values[ 1 ] = value1;
+	r->values[ 2 ] = value2;
+}
+
+#endif /*WRITER_H_*/